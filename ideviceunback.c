@@ -18,58 +18,36 @@
  *
  */ 
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <errno.h>
+#include <ctype.h>
 #include <stdint.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
-#include <sqlite3.h>
-#include "sha1.h"
+#include "unback.h"
 
 #define VERSION "1.03"
-#define TOOLS_BLOCK_READ_BUFFER_SIZE 4096
 #define PATH_MAX 4096
-#define MANIFEST_TYPE_NONSQL 0
-#define MANIFEST_TYPE_SQL 1
 
 struct globals {
-	int manifest_type;
-	int decode_only;
-	int linkonly;
+	struct unback *u;
+	struct unback_options o;
 	int verbose;
 	int debug;
 	int quiet;
 	char *inputpath;
 	char *outputpath;
-	char manifest_filename[PATH_MAX];
-	char hashfn[PATH_MAX];
+	int plan;
+	uint64_t *plan_files;
+	uint64_t *plan_bytes;
+	int stats;
+	int follow;
+	char *sink;
+	struct unback_rule *rules;
+	int tiers;
 } g;
 
-struct manrec {
-	unsigned char hash[SHA1_BLOCK_SIZE];
-	char hashstr[1024];
-	char domain[1024];
-	char filepath[1024];
-	char abspath[1024];
-	char digest[1024]; 
-	char enckey[1024];
-	char shain[2048];
-	uint16_t mode;
-	uint64_t inode;
-	uint32_t userid;
-	uint32_t groupid;
-	uint32_t mtime;
-	uint32_t atime;
-	uint32_t ctime;
-	uint64_t filelen;
-	uint8_t flags;
-	uint8_t numprops;
-};
-
 char help[]="ideviceunback [-i <input path>] [-o <output path>] [-v] [-q] [-h] [-V]\n\
 			 -i <input path> : Folder containing the Manifest.mbdb\n\
 			 -o <output path> : Where to copy the sorted files to\n\
@@ -77,62 +55,81 @@ char help[]="ideviceunback [-i <input path>] [-o <output path>] [-v] [-q] [-h] [
 			 -v : Verbose, use multiple times to increase verbosity\n\
 			 -q : Quiet mode\n\
 			 -m : Decode the manifest only, don't copy the files\n\
+			 -j <N|auto> : Copy with N worker threads, or let auto tune the number\n\
+			 --decoders <N> : Decode Manifest.db with N threads, each reading a rowid range\n\
+			 --ordered : Keep manifest order when decoding with several threads\n\
+			 --priority <domain>[/<path>][,...] : Extract matching files first, each use of this adds a tier.  Patterns can use * ? []\n\
+			 --smallest-first : Within each tier extract the smallest files first\n\
+			 --memory-budget <size[K|M|G]> : Hold no more than this in records, the plan for --priority and --smallest-first\n\
+			       spills to sorted runs on disk past it, and the copy queue makes the decoder wait\n\
+			 --spill-dir <path> : Where those runs go, TMPDIR or /tmp by default\n\
+			 --streaming : Drop copied data from the page cache as it goes, so the extraction doesn't push out everything else\n\
+			 --direct-above <size[K|M|G]> : Copy files of this size or more with O_DIRECT\n\
+			 --chunk-above <size[K|M|G]> : With -j, split files of this size or more in to ranges copied by several workers at once\n\
+			 --chunk-size <size[K|M|G]> : Size of those ranges, 64M by default\n\
+			 --durability <none|batch|file> : none leaves flushing to the kernel (default), batch has everything on disk by exit\n\
+			       without waiting on each file, file syncs every file before reporting it\n\
+			 --follow : Extract whilst idevicebackup2 is still writing the backup, start it alongside\n\
+			 --follow-idle <secs> : With --follow, treat the backup as done after this long without any activity\n\
+			 --prefetch <N> : Start reading the next N blobs in to the page cache ahead of the copies\n\
+			 --max-bandwidth <size[K|M|G]> : Copy no more than this many bytes per second, over all the workers\n\
+			 --max-iops <N> : Make no more than N reads and writes per second, over all the workers\n\
+			 --throttle-file <path> : Take new limits from this file whenever it changes, lines of \"bandwidth 50M\" or \"iops 200\"\n\
+			 --sink <fs|null|memory> : Write the output to the filesystem (default), nowhere, or in to memory.  null and memory\n\
+			       need no -o, and separate the read side from the write side when measuring throughput\n\
+			 --stats : Report progress and throughput on stderr\n\
+			 --shard <i/N> : Only extract slice i (0..N-1) of N, for splitting a backup across hosts\n\
+			 --plan <N> : Print file and byte totals for each of N shards, don't copy the files\n\
 			 -h : This help.\n\
 			 -V : Version\n\
 			 ";
 
 
 /*-----------------------------------------------------------------\
-  Date Code:	: 20160928-010850
-  Function Name	: filecopy
+  Date Code:	: 20170111-193005
+  Function Name	: add_priority
   Returns Type	: int
   ----Parameter List
-  1. char *source, 
-  2.  char *dest , 
+  1. struct globals *g, 
+  2.  char *spec , 
   ------------------
-  Exit Codes	: 
+  Exit Codes	: -1 if spec is empty
   Side Effects	: 
   --------------------------------------------------------------------
 Comments:
+	Adds the next priority tier from a --priority argument, a comma
+	separated list of domain or domain/path patterns.  An empty
+	domain matches any, eg "/Library/SMS/sms.db".
 
 --------------------------------------------------------------------
 Changes:
 
 \------------------------------------------------------------------*/
-int filecopy( char *source, char *dest )
-{
-	static char buffer[4096]; 
-	FILE *s, *d;
-	size_t rsize, wsize;
-
-	s = fopen(source, "r");
-	if (!s)
-	{
-		fprintf(stderr,"ERROR: Cannot open '%s' for reading (%s).", source, strerror(errno) );
-		return -1;
+int add_priority( struct globals *g, char *spec ) {
+	char *s, *tok, *save, *path;
+	struct unback_rule *r;
+	int added = 0;
+
+	s = strdup(spec);
+	for (tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		r = realloc(g->rules, (g->o.nrules +1) * sizeof(struct unback_rule));
+		if (r == NULL) break;
+		g->rules = r;
+		r = &g->rules[g->o.nrules++];
+
+		path = strchr(tok, '/');
+		if (path) *path++ = '\0';
+		r->domain = *tok ? tok : NULL;
+		r->path = path;
+		r->tier = g->tiers;
+		added++;
 	}
-
-	d = fopen(dest, "w");
-	if (!d)
-	{
-		fprintf(stderr,"ERROR: Cannot open '%s' for writing (%s).", dest, strerror(errno) );
+	if (added == 0) {
+		free(s);
 		return -1;
 	}
-
-	do {
-		rsize = fread( buffer, 1, TOOLS_BLOCK_READ_BUFFER_SIZE, s );
-		if (rsize > 0)
-		{
-			wsize = fwrite( buffer, 1, rsize, d );
-			if ( rsize != wsize )
-			{
-				fprintf(stderr,"WARNING: Read '%lu' bytes, but only could write '%lu'", rsize, wsize );
-			}
-		}
-	} while ( rsize > 0 );
-
-	fclose(s);
-	fclose(d);
+	g->tiers++;
+	g->o.rules = g->rules;
 
 	return 0;
 }
@@ -140,12 +137,13 @@ int filecopy( char *source, char *dest )
 
 
 /*-----------------------------------------------------------------\
-  Date Code:	: 20160928-010845
-  Function Name	: mkdirp
+  Date Code:	: 20160928-010921
+  Function Name	: parse_parameters
   Returns Type	: int
   ----Parameter List
-  1. char *path, 
-  2.  int mode , 
+  1. struct globals *g, 
+  2.  int argc, 
+  3.  char **argv , 
   ------------------
   Exit Codes	: 
   Side Effects	: 
@@ -156,63 +154,201 @@ Comments:
 Changes:
 
 \------------------------------------------------------------------*/
-int mkdirp( char *path, int mode )
-{
-	int result = 0;
-	char c = '/';
-	char *p = path;
-
-	if (*p == '/') p++;
-
-	while ((p != NULL)&&(*p != '\0'))
-	{
-		struct stat st;
-		int stat_result;
-
-		p = strchr(p,'/');
-		if (p != NULL)
-		{
-			while (*(p+1) == '/') p++;
-			c = *p;
-			*p = '\0';
-		}
+int parse_parameters( struct globals *g, int argc, char **argv ) {
 
-		stat_result = stat(path, &st);
-		if ((stat_result == 0)&&(S_ISDIR(st.st_mode)||S_ISLNK(st.st_mode)))
-		{
-			// If the link is good, then do nothing
-		} else if (stat_result == -1) {
-			int mkresult=0;
-
-			mkresult = mkdir(path,mode);
-			if (mkresult != 0)
-			{
-				fprintf(stderr,"ERROR: while attempting mkdir('%s'); '%s'",path,strerror(errno));
-				return -1;
-			}
-		} else {
-			fprintf(stderr,"ERROR: path %s seems to already exist as a non-directory",path);
-			return -1;
-		}
+	int i;
 
-		if (p != NULL)
-		{
-			*p = c; p++;
+	for (i = 0; i < argc; i++) {
+		if (argv[i][0] == '-') {
+			switch (argv[i][1]) {
+				case 'h': fprintf(stdout,"%s", help); exit(0); break;
+				case 'V': fprintf(stdout,"%s\n",  VERSION); exit(0); break;
+				case 'l': g->o.linkonly = 1; break;
+				case 'v': g->verbose++; break;
+				case 'q': g->quiet = 1; break;
+				case 'd': g->debug++; break;
+				case 'm': g->o.decode_only = 1; break;
+				case 'j':
+						  if ((i < argc -1) && (argv[i+1][0] != '-')){
+							  i++;
+							  if (strcmp(argv[i], "auto") == 0) g->o.jobs = UNBACK_JOBS_AUTO;
+							  else g->o.jobs = atoi(argv[i]);
+						  }
+						  break;
+				case 'i':
+						  if ((i < argc -1) && (argv[i+1][0] != '-')){
+							  i++;
+							  g->inputpath = strdup(argv[i]);
+						  }
+						  break;
+				case 'o':
+						  if ((i < argc -1) && (argv[i+1][0] != '-')){
+							  i++;
+							  g->outputpath = strdup(argv[i]);
+						  }
+						  break;
+				case '-':
+						  if (strcmp(argv[i], "--shard") == 0) {
+							  if ((i < argc -1) && (sscanf(argv[i+1], "%d/%d", &g->o.shard_index, &g->o.shard_count) == 2)
+									  && (g->o.shard_count > 0) && (g->o.shard_index >= 0) && (g->o.shard_index < g->o.shard_count)) {
+								  i++;
+								  break;
+							  }
+							  fprintf(stderr,"--shard needs a slice in the form i/N, with 0 <= i < N\n");
+							  exit(1);
+						  } else if (strcmp(argv[i], "--decoders") == 0) {
+							  if ((i < argc -1) && (atoi(argv[i+1]) > 0)) {
+								  i++;
+								  g->o.decoders = atoi(argv[i]);
+								  break;
+							  }
+							  fprintf(stderr,"--decoders needs the number of threads\n");
+							  exit(1);
+						  } else if (strcmp(argv[i], "--ordered") == 0) {
+							  g->o.ordered = 1;
+							  break;
+						  } else if (strcmp(argv[i], "--priority") == 0) {
+							  if ((i < argc -1) && (add_priority( g, argv[i+1] ) == 0)) {
+								  i++;
+								  break;
+							  }
+							  fprintf(stderr,"--priority needs domain or domain/path patterns\n");
+							  exit(1);
+						  } else if (strcmp(argv[i], "--smallest-first") == 0) {
+							  g->o.smallest_first = 1;
+							  break;
+						  } else if (strcmp(argv[i], "--memory-budget") == 0) {
+							  if ((i < argc -1) && (unback_parse_size( argv[i+1], &g->o.memory_budget ) == 0)) {
+								  i++;
+								  break;
+							  }
+							  fprintf(stderr,"--memory-budget needs a size, eg 256M\n");
+							  exit(1);
+						  } else if (strcmp(argv[i], "--spill-dir") == 0) {
+							  if (i < argc -1) {
+								  i++;
+								  g->o.spill_dir = argv[i];
+								  break;
+							  }
+							  fprintf(stderr,"--spill-dir needs a directory\n");
+							  exit(1);
+						  } else if (strcmp(argv[i], "--streaming") == 0) {
+							  g->o.streaming = 1;
+							  break;
+						  } else if (strcmp(argv[i], "--direct-above") == 0) {
+							  if ((i < argc -1) && (unback_parse_size( argv[i+1], &g->o.direct_above ) == 0)) {
+								  i++;
+								  break;
+							  }
+							  fprintf(stderr,"--direct-above needs a size, eg 64M\n");
+							  exit(1);
+						  } else if (strcmp(argv[i], "--chunk-above") == 0) {
+							  if ((i < argc -1) && (unback_parse_size( argv[i+1], &g->o.chunk_above ) == 0)) {
+								  i++;
+								  break;
+							  }
+							  fprintf(stderr,"--chunk-above needs a size, eg 1G\n");
+							  exit(1);
+						  } else if (strcmp(argv[i], "--chunk-size") == 0) {
+							  if ((i < argc -1) && (unback_parse_size( argv[i+1], &g->o.chunk_size ) == 0) && (g->o.chunk_size > 0)) {
+								  i++;
+								  break;
+							  }
+							  fprintf(stderr,"--chunk-size needs a size, eg 64M\n");
+							  exit(1);
+						  } else if (strncmp(argv[i], "--durability", 12) == 0) {
+							  char *level = NULL;
+
+							  if (argv[i][12] == '=') level = argv[i] +13;
+							  else if ((argv[i][12] == '\0') && (i < argc -1)) level = argv[++i];
+							  if (level) {
+								  if (strcmp(level, "none") == 0) { g->o.durability = UNBACK_DURABILITY_NONE; break; }
+								  if (strcmp(level, "batch") == 0) { g->o.durability = UNBACK_DURABILITY_BATCH; break; }
+								  if (strcmp(level, "file") == 0) { g->o.durability = UNBACK_DURABILITY_FILE; break; }
+							  }
+							  fprintf(stderr,"--durability needs one of none, batch or file\n");
+							  exit(1);
+						  } else if (strcmp(argv[i], "--follow") == 0) {
+							  g->follow = 1;
+							  break;
+						  } else if (strcmp(argv[i], "--follow-idle") == 0) {
+							  if ((i < argc -1) && (atoi(argv[i+1]) > 0)) {
+								  i++;
+								  g->o.tail_idle = atoi(argv[i]);
+								  break;
+							  }
+							  fprintf(stderr,"--follow-idle needs a number of seconds\n");
+							  exit(1);
+						  } else if (strcmp(argv[i], "--prefetch") == 0) {
+							  if ((i < argc -1) && (atoi(argv[i+1]) >= 0) && (isdigit(argv[i+1][0]))) {
+								  i++;
+								  g->o.prefetch = atoi(argv[i]);
+								  break;
+							  }
+							  fprintf(stderr,"--prefetch needs the number of blobs to read ahead\n");
+							  exit(1);
+						  } else if (strcmp(argv[i], "--max-bandwidth") == 0) {
+							  if ((i < argc -1) && (unback_parse_size( argv[i+1], &g->o.max_bandwidth ) == 0)) {
+								  i++;
+								  break;
+							  }
+							  fprintf(stderr,"--max-bandwidth needs a size per second, eg 50M\n");
+							  exit(1);
+						  } else if (strcmp(argv[i], "--max-iops") == 0) {
+							  if ((i < argc -1) && (unback_parse_size( argv[i+1], &g->o.max_iops ) == 0)) {
+								  i++;
+								  break;
+							  }
+							  fprintf(stderr,"--max-iops needs the number of operations per second\n");
+							  exit(1);
+						  } else if (strcmp(argv[i], "--throttle-file") == 0) {
+							  if (i < argc -1) {
+								  i++;
+								  g->o.throttle_file = argv[i];
+								  break;
+							  }
+							  fprintf(stderr,"--throttle-file needs the path of the control file\n");
+							  exit(1);
+						  } else if (strcmp(argv[i], "--sink") == 0) {
+							  if ((i < argc -1) && ((strcmp(argv[i+1], "fs") == 0) || (strcmp(argv[i+1], "null") == 0) || (strcmp(argv[i+1], "memory") == 0))) {
+								  i++;
+								  g->sink = argv[i];
+								  break;
+							  }
+							  fprintf(stderr,"--sink needs one of fs, null or memory\n");
+							  exit(1);
+						  } else if (strcmp(argv[i], "--stats") == 0) {
+							  g->stats = 1;
+							  break;
+						  } else if (strcmp(argv[i], "--plan") == 0) {
+							  if ((i < argc -1) && (atoi(argv[i+1]) > 0)) {
+								  i++;
+								  g->plan = atoi(argv[i]);
+								  break;
+							  }
+							  fprintf(stderr,"--plan needs the number of shards\n");
+							  exit(1);
+						  }
+						  fprintf(stderr,"Unknown parameter (%s)\n", argv[i]);
+						  exit(1);
+				default:
+						  fprintf(stderr,"Unknown parameter (%s)\n", argv[i]);
+						  exit(1);
+			}
 		}
-
 	}
-
-	return result;
+	return 0;
 }
 
 
 
 /*-----------------------------------------------------------------\
-  Date Code:	: 20160928-010856
-  Function Name	: *splitpath
-  Returns Type	: char
+  Date Code:	: 20161221-131252
+  Function Name	: stats_report
+  Returns Type	: void
   ----Parameter List
-  1. char *fullpath , 
+  1. char *label, 
+  2.  const struct unback_stats *s , 
   ------------------
   Exit Codes	: 
   Side Effects	: 
@@ -223,498 +359,223 @@ Comments:
 Changes:
 
 \------------------------------------------------------------------*/
-char *splitpath( char *fullpath ) {
-	char *p;
-
-	if (fullpath) {
-		p = strrchr(fullpath, '/');
-		if (p) {
-			*p = '\0';
-			p++;
-			return p;
-		}
-	}
-	return NULL;
+void stats_report( char *label, const struct unback_stats *s ) {
+	double secs = s->secs;
+
+	if (secs <= 0) secs = 1e-9;
+	fprintf(stderr,"%s: %lu files, %lu bytes, %.1f files/s, %.2f MB/s, %.2f ms/file, jobs %d"
+			, label
+			, s->files
+			, s->bytes
+			, s->files / secs
+			, s->bytes / secs / 1e6
+			, s->files ? s->latency_ns / 1e6 / s->files : 0.0
+			, s->jobs
+		   );
+	if (g.o.prefetch) fprintf(stderr,", prefetched %lu", s->prefetched);
+	if ((g.o.max_bandwidth)||(g.o.max_iops)||(g.o.throttle_file)) fprintf(stderr,", throttled %.1fs", s->throttle_ns / 1e9);
+	fprintf(stderr,", peak RSS %.1f MB", s->peak_rss / 1e6);
+	fprintf(stderr,"\n");
 }
 
-
-
-/*-----------------------------------------------------------------\
-  Date Code:	: 20160928-010902
-  Function Name	: readstr
-  Returns Type	: int
-  ----Parameter List
-  1. char **p, 
-  2.  char *buf , 
-  ------------------
-  Exit Codes	: 
-  Side Effects	: 
-  --------------------------------------------------------------------
-Comments:
-
---------------------------------------------------------------------
-Changes:
-
-\------------------------------------------------------------------*/
-int readstr( char **p, char *buf, size_t buf_sz ) {
-	static unsigned short mask[] = {192, 224, 240}; // UTF8 size detect mask
-	uint8_t i;
-	uint8_t slr[2];
-	uint16_t sl;
-	char *bp = *p;
-	char *bep;
-
-	slr[0] = *bp;
-	slr[1] = *(bp+1);
-	if ((slr[0] == 0xff)&&(slr[1] == 0xff)) {
-		bp+=2;
-		*p = bp;
-		if (buf) *buf = '\0';
-		return 0;
-	}
-	sl = (slr[0] << 8) + slr[1];
-	bp+=2;
-	bep = bp +sl;
-
-	if (buf) {
-		while ((*bp != '\0')&&(sl--)) {
-			i = 0;
-			if ((*bp & mask[0]) == mask[0]) i++;
-			if ((*bp & mask[1]) == mask[1]) i++;
-			if ((*bp & mask[2]) == mask[2]) i++;
-
-			if (buf_sz) {
-				*buf = *bp; 
-				buf++; 
-				buf_sz--;
-			}
-
-			bp+=(i+1);
-		}
-		*buf = '\0';
-	}
-
-	*p = bep;
-	return 0;
+void on_progress( void *arg, const struct unback_stats *s ) {
+	stats_report( "STATS", s );
 }
 
-/*-----------------------------------------------------------------\
-  Date Code:	: 20160928-010908
-  Function Name	: readuint8
-  Returns Type	: int
-  ----Parameter List
-  1. char **p, 
-  2.  uint8_t *i , 
-  ------------------
-  Exit Codes	: 
-  Side Effects	: 
-  --------------------------------------------------------------------
-Comments:
-
---------------------------------------------------------------------
-Changes:
 
-\------------------------------------------------------------------*/
-int readuint8( char **p, uint8_t *i ) {
-	*i = **p;
-
-	(*p)++;
-	return 0;
-}
 
 /*-----------------------------------------------------------------\
-  Date Code:	: 20160928-010913
-  Function Name	: readuint16
-  Returns Type	: int
+  Date Code:	: 20170111-193010
+  Function Name	: on_tier
+  Returns Type	: void
   ----Parameter List
-  1. char **p, 
-  2.  uint16_t *i , 
+  1. void *arg, 
+  2.  int tier, 
+  3.  uint64_t files , 
   ------------------
   Exit Codes	: 
   Side Effects	: 
   --------------------------------------------------------------------
 Comments:
+	Marker line for whatever is reading our output, printed even
+	with -q.  Tier N is the Nth --priority, the files matching none
+	of them come in the last tier.
 
 --------------------------------------------------------------------
 Changes:
 
 \------------------------------------------------------------------*/
-int readuint16( char **p, uint16_t *i ) {
-	uint16_t a = 0;
+void on_tier( void *arg, int tier, uint64_t files ) {
+	struct globals *g = arg;
 
-	memcpy(&a, *p, sizeof(uint16_t));
-	*i = (((a & 0x00FF) <<  8) | ((a & 0xFF00) >>  8));
-	(*p) += 2;
-	return 0;
+	fprintf(stdout,"TIER: %d%s complete, %lu files\n", tier, tier == g->tiers ? " (rest)" : "", files);
+	fflush(stdout);
 }
 
-/*-----------------------------------------------------------------\
-  Date Code:	: 20160928-010915
-  Function Name	: readuint32
-  Returns Type	: int
-  ----Parameter List
-  1. char **p, 
-  2.  uint32_t *i , 
-  ------------------
-  Exit Codes	: 
-  Side Effects	: 
-  --------------------------------------------------------------------
-Comments:
-
---------------------------------------------------------------------
-Changes:
-
-\------------------------------------------------------------------*/
-int readuint32( char **p, uint32_t *i ) {
-	uint32_t a = 0;
-
-	memcpy(&a, *p, sizeof(uint32_t));
-	*i = (
-			((a & 0x000000FFUL) << 24) | 
-			((a & 0x0000FF00UL) <<  8) | 
-			((a & 0x00FF0000UL) >>  8) | 
-			((a & 0xFF000000UL) >> 24) 
-		 );
-	(*p) += 4;
 
-	return 0;
-}
 
 /*-----------------------------------------------------------------\
-  Date Code:	: 20160928-010918
-  Function Name	: readuint64
-  Returns Type	: int
-  ----Parameter List
-  1. char **p, 
-  2.  uint64_t *i , 
-  ------------------
-  Exit Codes	: 
-  Side Effects	: 
-  --------------------------------------------------------------------
-Comments:
-
---------------------------------------------------------------------
-Changes:
-
-\------------------------------------------------------------------*/
-int readuint64( char **p, uint64_t *i ) {
-
-	uint64_t a = 0;
-
-	memcpy(&a, *p, sizeof(uint64_t));
-	*i = ((a & 0x00000000000000FFULL) << 56) | 
-		((a & 0x000000000000FF00ULL) << 40) | 
-		((a & 0x0000000000FF0000ULL) << 24) | 
-		((a & 0x00000000FF000000ULL) <<  8) | 
-		((a & 0x000000FF00000000ULL) >>  8) | 
-		((a & 0x0000FF0000000000ULL) >> 24) | 
-		((a & 0x00FF000000000000ULL) >> 40) | 
-		((a & 0xFF00000000000000ULL) >> 56);
-	(*p) += 8;
-	return 0;
-}
-
-
-/*-----------------------------------------------------------------\
-  Date Code:	: 20160928-010921
-  Function Name	: parse_parameters
-  Returns Type	: int
+  Date Code:	: 20161221-131244
+  Function Name	: print_entry
+  Returns Type	: void
   ----Parameter List
   1. struct globals *g, 
-  2.  int argc, 
-  3.  char **argv , 
+  2.  const struct unback_record *r , 
   ------------------
   Exit Codes	: 
   Side Effects	: 
   --------------------------------------------------------------------
 Comments:
+	Reports a freshly decoded manifest record, -v dumps the whole
+	mbdb record and -d the Manifest.db 'file' plist.
 
 --------------------------------------------------------------------
 Changes:
+	Was the reporting half of manifest_pre10_decode() and
+	sq3_row().
 
 \------------------------------------------------------------------*/
-int parse_parameters( struct globals *g, int argc, char **argv ) {
-
+void print_entry( struct globals *g, const struct unback_record *r ) {
+	struct unback_string name, value;
 	int i;
 
-	for (i = 0; i < argc; i++) {
-		if (argv[i][0] == '-') {
-			switch (argv[i][1]) {
-				case 'h': fprintf(stdout,"%s", help); exit(0); break;
-				case 'V': fprintf(stdout,"%s\n",  VERSION); exit(0); break;
-				case 'l': g->linkonly = 1; break;
-				case 'v': g->verbose++; break;
-				case 'q': g->quiet = 1; break;
-				case 'd': g->debug++; break;
-				case 'm': g->decode_only = 1; break;
-				case 'i':
-						  if ((i < argc -1) && (argv[i+1][0] != '-')){
-							  i++;
-							  g->inputpath = strdup(argv[i]);
-						  }
-						  break;
-				case 'o':
-						  if ((i < argc -1) && (argv[i+1][0] != '-')){
-							  i++;
-							  g->outputpath = strdup(argv[i]);
-						  }
-						  break;
-				default:
-						  fprintf(stderr,"Unknown parameter (%s)\n", argv[i]);
-						  exit(1);
+	if (unback_manifest_type( g->u ) == UNBACK_MANIFEST_SQL) {
+		if ((g->debug)&&(r->file.s)) fprintf(stdout,"%.*s", (int)r->file.len, r->file.s);
+		if ((r->type != UNBACK_TYPE_FILE)&&(!g->quiet)) {
+			fprintf(stdout,"OTHER: %.*s-%.*s\n", (int)r->domain.len, r->domain.s, (int)r->path.len, r->path.s);
+		}
+		return;
+	}
+
+	if (g->verbose) {
+		fprintf(stdout, "%.*s|%.*s|%.*s|%.*s|%.*s"
+				, (int)r->domain.len, r->domain.s
+				, (int)r->path.len, r->path.s
+				, (int)r->target.len, r->target.s
+				, (int)r->digest.len, r->digest.s
+				, (int)r->enckey.len, r->enckey.s
+			   );
+
+		fprintf(stdout,"|%c%c%c"
+				, r->mode & 0x4 ? 'r' : '-'
+				, r->mode & 0x2 ? 'w' : '-'
+				, r->mode & 0x1 ? 'x' : '-'
+			   );
+
+		fprintf(stdout,"|%lu|uid:%u gid:%u|Times(%u,%u,%u)|Size:%ld bytes|Flags:%02x|Numprops:%u"
+				, r->inode
+				, r->uid
+				, r->gid
+				, r->mtime
+				, r->atime
+				, r->ctime
+				, r->size
+				, r->protection
+				, r->numprops
+			   );
+
+		if ((r->numprops)&&(g->verbose > 1)) {
+			fprintf(stdout,"\n");
+			for (i = 0; unback_record_prop( r, i, &name, &value ) == 0; i++) {
+				fprintf(stdout,"\t%.*s=%.*s\n", (int)name.len, name.s, (int)value.len, value.s);
 			}
 		}
+		fprintf(stdout,"\n");
+	}
+
+	if (r->type == UNBACK_TYPE_FILE) {
+		if (g->verbose) fprintf(stdout,"\n");
+	} else if (r->type == UNBACK_TYPE_DIR) {
+		if (!g->quiet) fprintf(stdout,"DIR: %.*s-%.*s\n", (int)r->domain.len, r->domain.s, (int)r->path.len, r->path.s);
+	} else if (r->type == UNBACK_TYPE_SYMLINK) {
+		if (!g->quiet) fprintf(stdout,"LINK: %.*s-%.*s\n", (int)r->domain.len, r->domain.s, (int)r->path.len, r->path.s);
 	}
-	return 0;
 }
 
+
+
 /*-----------------------------------------------------------------\
-  Date Code:	: 20161221-131244
-  Function Name	: manifest_pre10_decode
-  Returns Type	: int
+  Date Code:	: 20161221-131245
+  Function Name	: on_event
+  Returns Type	: void
   ----Parameter List
-  1. void, 
+  1. void *arg, 
+  2.  int event, 
+  3.  const struct unback_record *r , 
   ------------------
   Exit Codes	: 
   Side Effects	: 
   --------------------------------------------------------------------
 Comments:
+	Called from the copy workers as well as the decoders, so each
+	report line is written with a single fprintf().
 
 --------------------------------------------------------------------
 Changes:
 
 \------------------------------------------------------------------*/
-int manifest_pre10_decode( struct globals *g ) {
-	struct manrec m;
-	SHA1_CTX ctx;
-
-	int i;
-	char *addr, *p, *ep;
-	int fd;
-	struct stat sb;
-
-	fd = open(g->manifest_filename, O_RDONLY);
-	if (fd == -1) {
-		fprintf(stderr,"Cannot open '%s' for reading (%s)\n", g->manifest_filename, strerror(errno));
-		exit(1);
-	}
-
-	/*
-	 * Get manifest filesize so we can mmap the whole file 
-	 */
-	if (fstat(fd, &sb) == -1)  {
-		fprintf(stderr,"Cannot stat '%s' (%s)\n", g->manifest_filename, strerror(errno));
-		exit(1);
-	}
-
-	/*
-	 * Attempt to mmap the file
-	 */
-	addr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (addr == MAP_FAILED) {
-		fprintf(stderr,"Cannot mmap '%s' (%s)\n", g->manifest_filename, strerror(errno));
-		exit(1);
-	}
+void on_event( void *arg, int event, const struct unback_record *r ) {
+	struct globals *g = arg;
+	char hashfn[PATH_MAX];
+	char *how = "";
 
-	/*
-	 * Verify the Manifest file
-	 */
-	p = addr;
-	ep = addr +sb.st_size;
-	if (memcmp(p, "mbdb", 4)) {
-		fprintf(stderr,"\"%s\" does not appear to be a folder containing a valid Manifest.mbdb file", g->inputpath);
-		exit(1);
+	if (event == UNBACK_EVENT_ENTRY) {
+		print_entry( g, r );
+		return;
 	}
 
-	p = addr +6; // jump the header
-	while ( p < ep ) {
-
-		readstr(&p, m.domain, sizeof(m.domain)); // domain
-		readstr(&p, m.filepath, sizeof(m.filepath)); // filepath
-		readstr(&p, m.abspath, sizeof(m.abspath)); // absolute path for symlinks
-		readstr(&p, m.digest, sizeof(m.digest)); // digest
-		readstr(&p, m.enckey, sizeof(m.enckey)); // encryption key
-
-		if (g->verbose) {
-			fprintf(stdout, "%s|%s|%s|%s|%s"
-					, m.domain
-					, m.filepath
-					, m.abspath
-					, m.digest
-					, m.enckey
-				   );
-		}
-
-		readuint16(&p, &m.mode); // mode
-		readuint64(&p, &m.inode); // inode#
-		readuint32(&p, &m.userid); // uid
-		readuint32(&p, &m.groupid); // gid
-		readuint32(&p, &m.mtime); // last modified time
-		readuint32(&p, &m.atime); // last accessed time
-		readuint32(&p, &m.ctime); // created time
-		readuint64(&p, &m.filelen); // size
-		readuint8(&p, &m.flags); // protection class
-		readuint8(&p, &m.numprops); // number of properties
-
-		if (g->verbose) {
-			fprintf(stdout,"|%c%c%c"
-					, m.mode & 0x4 ? 'r' : '-'
-					, m.mode & 0x2 ? 'w' : '-'
-					, m.mode & 0x1 ? 'x' : '-'
-				   );
-
-			fprintf(stdout,"|%lu|uid:%u gid:%u|Times(%u,%u,%u)|Size:%ld bytes|Flags:%02x|Numprops:%u"
-					, m.inode
-					, m.userid
-					, m.groupid
-					, m.mtime
-					, m.atime
-					, m.ctime
-					, m.filelen
-					, m.flags
-					, m.numprops
-				   );
-		}
-
-
-		if (m.numprops) {
-			if (g->verbose > 1) fprintf(stdout,"\n");
-			for (i = 0 ; i < m.numprops; i++) {
-				char s1[1024], s2[1024];
-				readstr(&p, s1, sizeof(s1));
-				readstr(&p, s2, sizeof(s2));
-				if (g->verbose > 1) fprintf(stdout,"\t%s=%s\n",s1,s2);
-			}
-		}
-
-		if (g->verbose) fprintf(stdout,"\n");
-
-		/*
-		 * Compute the SHA1 hash for the manifest item
-		 */
-		snprintf(m.shain, sizeof(m.shain),"%s-%s", m.domain, m.filepath);
-		sha1_init(&ctx);
-		sha1_update(&ctx, (uint8_t *)m.shain, strlen(m.shain));
-		sha1_final(&ctx, m.hash);
-
-		for (i=0; i < SHA1_BLOCK_SIZE; i++) {
-			sprintf(m.hashstr+(i*2),"%02hhx",m.hash[i]);
-		}
-
-		/*
-		 * Final interpretation of the decoded manifest item and 
-		 * deciding what to do with it.
-		 */
-		if ((m.mode & 0xE000)==0x8000) {
-			snprintf(g->hashfn, sizeof(g->hashfn), "%s/%s", g->inputpath, m.hashstr);
-			if( access( g->hashfn, F_OK ) != -1 ) {
-				char newpath[PATH_MAX];
-				char *fn;
-				if (g->verbose) fprintf(stdout,"\n");
-				if (!g->quiet) fprintf(stdout,"FILE: %s =(exists)=> %s", g->hashfn, m.filepath);
-				snprintf(newpath, sizeof(newpath),"%s/%s", g->outputpath, m.filepath);
-				if (g->decode_only == 0) {
-					fn = splitpath(newpath);
-					if (fn) {
-						mkdirp( newpath, S_IRWXU );
-						*(fn -1) = '/';
-						if (g->linkonly) {
-							link( g->hashfn, newpath );
-							if (!g->quiet) fprintf(stdout, " linked");
-						} else {
-							filecopy( g->hashfn, newpath);
-							if (!g->quiet) fprintf(stdout, " copied");
-						}	
-					}
-				}
-				if (!g->quiet) fprintf(stdout,"\n");
-			} else {
-				if (g->verbose) fprintf(stdout, "%s =Not present=> %s\n", g->hashfn, m.filepath);
-			}
-		} else if ((m.mode & 0xE000) == 0x4000) {
-			if (!g->quiet) fprintf(stdout,"DIR: %s-%s\n",m.domain, m.filepath);
-		} else if ((m.mode & 0xE000) == 0xA000) {
-			if (!g->quiet) fprintf(stdout,"LINK: %s-%s\n", m.domain, m.filepath);
-		}
+	unback_blob_path( g->u, r, hashfn, sizeof(hashfn) );
+	switch (event) {
+		case UNBACK_EVENT_MISSING:
+			if (g->verbose) fprintf(stdout, "%s =Not present=> %.*s\n", hashfn, (int)r->path.len, r->path.s);
+			return;
+		case UNBACK_EVENT_COPIED: how = " copied"; break;
+		case UNBACK_EVENT_LINKED: how = " linked"; break;
+		case UNBACK_EVENT_FAILED: how = " failed"; break;
 	}
 
-	munmap(addr, sb.st_size);
-	close(fd);
-
-	return 0;
+	if (!g->quiet) fprintf(stdout,"FILE: %s =(exists)=> %.*s%s\n", hashfn, (int)r->path.len, r->path.s, how);
 }
 
 
 
 /*-----------------------------------------------------------------\
-  Date Code:	: 20161221-132159
-  Function Name	: int
-  Returns Type	: static
+  Date Code:	: 20161221-131901
+  Function Name	: plan_filter
+  Returns Type	: int
   ----Parameter List
-  1. sqlite3_callback( void *NotUsed, 
-  2.  int argc, 
-  3.  char **argv, 
-  4.  char **azColName , 
+  1. void *arg, 
+  2.  const struct unback_record *r , 
   ------------------
-  Exit Codes	: 
+  Exit Codes	: 0, nothing gets extracted
   Side Effects	: 
   --------------------------------------------------------------------
 Comments:
+	--plan only counts each blob against its shard.
 
 --------------------------------------------------------------------
 Changes:
 
 \------------------------------------------------------------------*/
-static int sq3_callback( void *NotUsed, int argc, char **argv, char **azColName ) {
-
-	char *n="", *fileID, *domain, *relativePath, *flags, *file;
-
-	fileID = argv[0]?argv[0]:n;
-	domain = argv[1]?argv[1]:n;
-	relativePath = argv[2]?argv[2]:n;
-	flags = argv[3]?argv[3]:n;
-	file = argv[4]?argv[4]:n;
-
-
-	if (g.debug) fprintf(stdout,"%s", file);
-
-	if (flags[0] == '1') {
-		snprintf(g.hashfn, sizeof(g.hashfn), "%s/%c%c/%s", g.inputpath, fileID[0], fileID[1], fileID);
-		if( access( g.hashfn, F_OK ) != -1 ) {
-			char newpath[PATH_MAX];
-			char *fn;
-			if (!g.quiet) fprintf(stdout,"FILE: %s =(exists)=> %s", g.hashfn, relativePath);
-			snprintf(newpath, sizeof(newpath),"%s/%s", g.outputpath, relativePath);
-			if (g.decode_only == 0) {
-				fn = splitpath(newpath);
-				if (fn) {
-					mkdirp( newpath, S_IRWXU );
-					*(fn -1) = '/';
-					if (g.linkonly) {
-						link( g.hashfn, newpath );
-						if (!g.quiet) fprintf(stdout, " linked");
-					} else {
-						filecopy( g.hashfn, newpath);
-						if (!g.quiet) fprintf(stdout, " copied");
-					}
-				}
-			}
-			if (!g.quiet) fprintf(stdout,"\n");
-		} else {
-			if (g.verbose) fprintf(stdout, "%s =Not present=> %s\n", g.hashfn, relativePath);
-		}
-	} else {
-		if (!g.quiet) fprintf(stdout,"OTHER: %s-%s\n", domain, relativePath);
+int plan_filter( void *arg, const struct unback_record *r ) {
+	struct globals *g = arg;
+	struct stat st;
+	int shard;
+
+	shard = unback_shard_of( r->fileID.s, g->plan );
+	if (unback_blob_stat( g->u, r, &st ) == 0) {
+		__atomic_add_fetch(&g->plan_files[shard], 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&g->plan_bytes[shard], st.st_size, __ATOMIC_RELAXED);
 	}
 
 	return 0;
-
 }
 
 
+
 /*-----------------------------------------------------------------\
-  Date Code:	: 20161221-131836
-  Function Name	: manifest_sqlite3_decode
+  Date Code:	: 20161221-131900
+  Function Name	: plan_report
   Returns Type	: int
   ----Parameter List
   1. struct globals *g , 
@@ -723,37 +584,33 @@ static int sq3_callback( void *NotUsed, int argc, char **argv, char **azColName
   Side Effects	: 
   --------------------------------------------------------------------
 Comments:
+	Prints the per shard totals gathered in --plan mode, along with
+	how far the largest shard is above the mean so the shard count
+	can be chosen to balance on bytes rather than file count.
 
 --------------------------------------------------------------------
 Changes:
 
 \------------------------------------------------------------------*/
-int manifest_sqlite3_decode( struct globals *g ) {
-
-	int rc;
-	sqlite3 *db;
-	char sql[1024];
-	char *zErrMsg;
-
-	rc = sqlite3_open( g->manifest_filename, &db );
-
-	if ( rc ) {
-		fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
-		sqlite3_close(db);
-		return (1);
-	}
+int plan_report( struct globals *g ) {
+	uint64_t files = 0, bytes = 0, maxbytes = 0;
+	int i;
 
-	snprintf(sql, sizeof(sql), "SELECT fileID, domain, relativePath, flags, file from Files;");
-	rc = sqlite3_exec( db, sql, sq3_callback, 0, &zErrMsg);
-	if ( rc != SQLITE_OK ) {
-		fprintf(stderr,"SQL Error: %s\n", zErrMsg);
+	for (i = 0; i < g->plan; i++) {
+		fprintf(stdout,"SHARD: %d/%d %lu files %lu bytes\n", i, g->plan, g->plan_files[i], g->plan_bytes[i]);
+		files += g->plan_files[i];
+		bytes += g->plan_bytes[i];
+		if (g->plan_bytes[i] > maxbytes) maxbytes = g->plan_bytes[i];
 	}
-
-	sqlite3_close(db);
+	fprintf(stdout,"TOTAL: %lu files %lu bytes", files, bytes);
+	if (bytes) fprintf(stdout,", largest shard %.1f%% of mean", 100.0 * maxbytes * g->plan / bytes);
+	fprintf(stdout,"\n");
 
 	return 0;
 }
 
+
+
 /*-----------------------------------------------------------------\
   Date Code:	: 20160928-010924
   Function Name	: main
@@ -769,12 +626,13 @@ Comments:
 
 --------------------------------------------------------------------
 Changes:
+	Decoding and extraction moved in to libunback.
 
 \------------------------------------------------------------------*/
 int main( int argc, char **argv ) {
 
-	int fd;
-	struct stat statbuf;
+	struct unback_stats stats;
+	int rc;
 
 	if (argc < 4) {
 		fprintf(stderr,"%s\n",help);
@@ -782,15 +640,24 @@ int main( int argc, char **argv ) {
 	}
 
 	g.debug = 0;
-	g.linkonly = 0;
 	g.verbose = 0;
 	g.quiet = 0;
-	g.decode_only = 0;
 	g.inputpath = NULL;
 	g.outputpath = NULL;
+	g.plan = 0;
+	g.stats = 0;
+	unback_options_init( &g.o );
 
 	parse_parameters( &g, argc, argv );
 
+	if (g.plan) {
+		g.o.decode_only = 1;
+		g.quiet = 1;
+		g.plan_files = calloc(g.plan, sizeof(uint64_t));
+		g.plan_bytes = calloc(g.plan, sizeof(uint64_t));
+		g.o.filter = plan_filter;
+	}
+
 	if (g.quiet)  { g.verbose = 0; g.debug = 0; }
 
 	if (!g.inputpath) {
@@ -798,7 +665,10 @@ int main( int argc, char **argv ) {
 		exit(1);
 	}
 
-	if (!g.outputpath) {
+	if ((g.sink)&&(strcmp(g.sink, "null") == 0)) g.o.sink = unback_sink_null();
+	if ((g.sink)&&(strcmp(g.sink, "memory") == 0)) g.o.sink = unback_sink_memory();
+
+	if ((!g.outputpath)&&(!g.plan)&&(!g.o.sink)) {
 		fprintf(stderr,"No output path specified.\n%s\n", help);
 		exit(1);
 	}
@@ -807,28 +677,32 @@ int main( int argc, char **argv ) {
 		fprintf(stdout,"Source: %s\nDest: %s\n", g.inputpath, g.outputpath);
 	}
 
-	/*
-	 * Attempt to open the manifest file
-	 */
-	/* Determine which Manifest type we have */
-	snprintf(g.manifest_filename, sizeof(g.manifest_filename),"%s/Manifest.mbdb", g.inputpath);
-	fd = stat( g.manifest_filename, &statbuf );
-	if (fd == 0) {
-		g.manifest_type = MANIFEST_TYPE_NONSQL;
-		manifest_pre10_decode( &g );
-
-	} else {
-		snprintf(g.manifest_filename, sizeof(g.manifest_filename),"%s/Manifest.db", g.inputpath);
-		fd = stat( g.manifest_filename, &statbuf );
-		if (fd == 0) {
-			g.manifest_type = MANIFEST_TYPE_SQL;
-			manifest_sqlite3_decode( &g );
-		} else {
-			fprintf(stderr,"Could not load SQLite3 (iOS 10+) manifest (%s)\n", g.manifest_filename);
-		}
+	if (g.follow) g.u = unback_open_live( g.inputpath );
+	else g.u = unback_open( g.inputpath );
+	if (g.u == NULL) exit(1);
+
+	g.o.outputpath = g.outputpath;
+	g.o.event = on_event;
+	g.o.arg = &g;
+	if (g.debug) g.o.cursor_flags |= UNBACK_CURSOR_FILEBLOB;
+	if (g.stats) g.o.progress = on_progress;
+	g.o.tier_done = on_tier;
+
+	if (g.follow) rc = unback_tail( g.u, &g.o, &stats );
+	else rc = unback_extract( g.u, &g.o, &stats );
+
+	if (g.stats) stats_report( "TOTAL", &stats );
+	if ((g.stats)&&(g.sink)&&(strcmp(g.sink, "memory") == 0)) {
+		uint64_t files, bytes;
+
+		unback_sink_memory_usage( g.o.sink, &files, &bytes );
+		fprintf(stderr,"MEMORY: %lu files, %lu bytes held\n", files, bytes);
 	}
+	if (g.plan) plan_report( &g );
 
+	unback_close( g.u );
+	unback_sink_free( g.o.sink );
 
-	return 0;
+	return rc == 0 ? 0 : 1;
 
 }
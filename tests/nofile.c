@@ -0,0 +1,189 @@
+/*
+ * MIT licence
+ *
+ *
+ Copyright (c) 2016 Paul L Daniels
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the Software
+ is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ *
+ */
+
+/*
+ * Extracts a generated Manifest.db backup with durability batch and
+ * several copy workers under a lowered RLIMIT_NOFILE, every file
+ * has to come out.  Exits 0 on success.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sqlite3.h>
+#include "../sha1.h"
+#include "../unback.h"
+
+#define TEST_FILES 2701
+#define TEST_DIRS 400
+#define TEST_NOFILE 512
+
+struct counts {
+	int copied;
+	int failed;
+};
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170310-201010
+  Function Name	: make_backup
+  Returns Type	: int
+  ----Parameter List
+  1. const char *root ,
+  ------------------
+  Exit Codes	: -1 if the backup couldn't be written
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+	TEST_FILES small blobs spread over TEST_DIRS output folders, so
+	the directory cache keeps evicting and the shards all get used.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int make_backup( const char *root ) {
+	static char hexdigits[] = "0123456789abcdef";
+	char path[4096], rel[256], fileID[SHA1_BLOCK_SIZE * 2 +1];
+	uint8_t hash[SHA1_BLOCK_SIZE];
+	SHA1_CTX ctx;
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	int i, j, fd, result = 0;
+
+	snprintf(path, sizeof(path), "%s/Manifest.db", root);
+	if (sqlite3_open( path, &db ) != SQLITE_OK) return -1;
+	sqlite3_exec( db, "CREATE TABLE Files (fileID TEXT PRIMARY KEY, domain TEXT, relativePath TEXT, flags INTEGER, file BLOB);"
+			"BEGIN;", NULL, NULL, NULL );
+	if (sqlite3_prepare_v2( db, "INSERT INTO Files VALUES (?, 'HomeDomain', ?, 1, NULL);", -1, &stmt, NULL ) != SQLITE_OK) {
+		sqlite3_close( db );
+		return -1;
+	}
+
+	for (i = 0; (i < TEST_FILES)&&(result == 0); i++) {
+		snprintf(rel, sizeof(rel), "Library/d%d/f%d.bin", i % TEST_DIRS, i);
+		snprintf(path, sizeof(path), "HomeDomain-%s", rel);
+		sha1_init( &ctx );
+		sha1_update( &ctx, (uint8_t *)path, strlen(path) );
+		sha1_final( &ctx, hash );
+		for (j = 0; j < SHA1_BLOCK_SIZE; j++) {
+			fileID[j *2] = hexdigits[hash[j] >> 4];
+			fileID[j *2 +1] = hexdigits[hash[j] & 0x0f];
+		}
+		fileID[SHA1_BLOCK_SIZE * 2] = '\0';
+
+		snprintf(path, sizeof(path), "%s/%.2s", root, fileID);
+		mkdir(path, S_IRWXU);
+		snprintf(path, sizeof(path), "%s/%.2s/%s", root, fileID, fileID);
+		fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+		if ((fd == -1)||(write(fd, rel, strlen(rel)) != (ssize_t)strlen(rel))) result = -1;
+		if (fd != -1) close(fd);
+
+		sqlite3_bind_text( stmt, 1, fileID, -1, SQLITE_TRANSIENT );
+		sqlite3_bind_text( stmt, 2, rel, -1, SQLITE_TRANSIENT );
+		if (sqlite3_step( stmt ) != SQLITE_DONE) result = -1;
+		sqlite3_reset( stmt );
+	}
+	sqlite3_finalize( stmt );
+	if (sqlite3_exec( db, "COMMIT;", NULL, NULL, NULL ) != SQLITE_OK) result = -1;
+	sqlite3_close( db );
+
+	return result;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170310-201020
+  Function Name	: count_event
+  Returns Type	: void
+  ----Parameter List
+  1. void *arg,
+  2.  int event,
+  3.  const struct unback_record *r ,
+  ------------------
+  Exit Codes	:
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void count_event( void *arg, int event, const struct unback_record *r ) {
+	struct counts *n = arg;
+
+	if (event == UNBACK_EVENT_COPIED) __atomic_add_fetch(&n->copied, 1, __ATOMIC_RELAXED);
+	if (event == UNBACK_EVENT_FAILED) __atomic_add_fetch(&n->failed, 1, __ATOMIC_RELAXED);
+}
+
+
+
+int main( int argc, char **argv ) {
+	char root[] = "/tmp/unback-nofile-XXXXXX";
+	char input[4096], output[4096], cmd[4200];
+	struct unback_options o;
+	struct counts n = { 0, 0 };
+	struct rlimit rl;
+	struct unback *u;
+	int rc;
+
+	if (mkdtemp(root) == NULL) {
+		fprintf(stderr,"Cannot make a temporary folder (%s)\n", strerror(errno));
+		return 1;
+	}
+	snprintf(input, sizeof(input), "%s/backup", root);
+	snprintf(output, sizeof(output), "%s/out", root);
+	mkdir(input, S_IRWXU);
+	if (make_backup( input ) != 0) {
+		fprintf(stderr,"Cannot write the test backup in '%s'\n", input);
+		return 1;
+	}
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = TEST_NOFILE;
+		if (setrlimit(RLIMIT_NOFILE, &rl) == -1) fprintf(stderr,"Cannot lower RLIMIT_NOFILE (%s)\n", strerror(errno));
+	}
+
+	u = unback_open( input );
+	if (u == NULL) return 1;
+	unback_options_init( &o );
+	o.outputpath = output;
+	o.jobs = 16;
+	o.durability = UNBACK_DURABILITY_BATCH;
+	o.event = count_event;
+	o.arg = &n;
+	rc = unback_extract( u, &o, NULL );
+	unback_close( u );
+
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", root);
+	if (system(cmd) != 0) fprintf(stderr,"Cannot remove '%s'\n", root);
+
+	printf("nofile: %d copied, %d failed, returned %d\n", n.copied, n.failed, rc);
+
+	return ((rc == 0)&&(n.copied == TEST_FILES)&&(n.failed == 0)) ? 0 : 1;
+}
@@ -0,0 +1,5243 @@
+/*
+ * MIT licence
+ *
+ *
+ Copyright (c) 2016 Paul L Daniels
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the Software
+ is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sqlite3.h>
+#include "sha1.h"
+#include "unback.h"
+
+#define TOOLS_BLOCK_READ_BUFFER_SIZE 65536
+#define PATH_MAX 4096
+#define DIRCACHE_SIZE 128
+#define POOL_MAX_THREADS 64
+#define POOL_AUTO_START 4
+#define POOL_TICK_MS 250
+#define POOL_AUTO_OP_BYTES 65536
+#define DECODERS_MAX 64
+#define SQ3_PART_QUEUE 4096
+#define MBDB_RECORD_FIXED 40 // mode .. numprops
+#define STREAM_CHUNK (8 * 1024 * 1024)
+#define DIRECT_ALIGN 4096
+#define DIRECT_BUFFER_SIZE (1024 * 1024)
+#define SYNC_MAX_FDS 32      // most the syncer holds open, queued and being synced
+#define SYNC_FD_SPARE 32     // left for stdio, sqlite and the like
+#define SYNC_BATCH_BYTES (64 * 1024 * 1024)
+#define TAIL_EVENT_BUFFER 65536
+#define TAIL_PENDING 0x01   // finalised before the manifest listed it
+#define TAIL_DONE 0x02      // extracted whilst tailing
+#define TAIL_COPYING 0x04   // handed to the copy, not yet finished
+#define PREFETCH_MAX 4096
+#define PREFETCH_THREADS 4
+#define PREFETCH_BYTES (1024 * 1024) // per blob, so big files don't flush the cache
+#define CHUNK_SIZE (64 * 1024 * 1024)   // o.chunk_size default
+#define MEMSINK_BUCKETS 65536
+#define THROTTLE_BYTES 0
+#define THROTTLE_OPS 1
+#define THROTTLE_BURST 4    // a full bucket holds 1/4 second of the limit
+
+/*
+ * An opened backup, the input side shared by every cursor and
+ * extraction on it.
+ */
+struct unback {
+	char *inputpath;
+	char manifest_filename[PATH_MAX];
+	int manifest_type;
+	int input_fd;
+	int shard_fd[256];
+	pthread_mutex_t shard_lock;
+};
+
+/*
+ * Walks a manifest.  For Manifest.mbdb the file is mmap()'d and the
+ * records point straight in to it, for Manifest.db they point in to
+ * the current sqlite3 row.
+ */
+struct unback_cursor {
+	struct unback *u;
+	int flags;
+	int fd;
+	char *addr, *p, *ep;
+	size_t size;
+	char fileID[SHA1_BLOCK_SIZE * 2 +1];
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+};
+
+/*
+ * Open output directory descriptor, keyed on the path relative
+ * to the output root.  Least recently used entries get closed
+ * when the cache is full.
+ */
+struct dircache_entry {
+	char *path;
+	int fd;
+	int refs;
+	uint64_t used;
+};
+
+/*
+ * A record which has to outlive its cursor row, waiting for a copy
+ * worker or for --ordered.  The strings are stored in the same
+ * allocation, straight after the struct, the mbdb properties are
+ * not kept.
+ *
+ * Copy workers also get the ranges of chunked copies this way, with
+ * chunk set and no record.
+ */
+struct recbuf {
+	struct recbuf *next;
+	size_t alloc;         // bytes, struct and strings, 0 for a range
+	struct chunked *chunk;
+	off_t off;
+	struct unback_record r;
+};
+
+/*
+ * Copy worker pool.  'limit' is how many of the workers may be
+ * copying at once; fixed with jobs N, or moved by the controller
+ * thread with UNBACK_JOBS_AUTO.  The queue holds up to 4 jobs per
+ * running worker so the depth follows the limit.
+ */
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t space;
+	pthread_cond_t tick;
+	pthread_cond_t idle;
+	pthread_t threads[POOL_MAX_THREADS];
+	pthread_t controller;
+	int controlled;       // the controller thread is running
+	int nthreads;
+	int limit;
+	int active;
+	int queued;
+	size_t queued_bytes;
+	int done;
+	struct recbuf *head, *tail;
+
+	uint64_t files;       // completed, updated atomically
+	uint64_t bytes;       // copied so far, updated atomically
+	uint64_t latency_ns;  // summed per file copy time
+
+	double tune_score;
+	double tune_latency;
+	double tune_size;
+	int tune_dir;
+	int tune_step;
+};
+
+/*
+ * Read-ahead stage.  File records wait in the 'ahead' queue until
+ * o.prefetch newer ones have arrived, and as each one enters, its
+ * fileID goes in to the 'ids' ring where the prefetch threads open
+ * the blob and ask the kernel to start reading it.  By the time a
+ * record reaches the copy its blob should be in the page cache.
+ */
+struct prefetch {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t threads[PREFETCH_THREADS];
+	int nthreads;
+	int done;
+	struct recbuf *head, *tail;
+	int queued;
+	char (*ids)[SHA1_BLOCK_SIZE * 2 +1];
+	unsigned long put, get;
+
+	uint64_t hinted;      // blobs handed to the kernel, updated atomically
+};
+
+/*
+ * UNBACK_DURABILITY_BATCH syncer.  Copied files, and output
+ * directories as they leave the directory cache, are handed over
+ * still open.  A background thread fsync()s and closes them a batch
+ * at a time, once half of 'max' or SYNC_BATCH_BYTES have built up,
+ * so copies seldom wait on the disk.  'held' counts both the queued
+ * fds and the batch being synced, and never goes past 'max', which
+ * is sized from RLIMIT_NOFILE.
+ */
+struct syncer {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t space;
+	pthread_t thread;
+	int running;
+	int done;
+	int fds[SYNC_MAX_FDS];
+	int count;
+	int held;
+	int max;
+	uint64_t bytes;
+	uint64_t errors;
+};
+
+/*
+ * Token buckets for o.max_bandwidth and o.max_iops, shared by every
+ * copy.  A taker may run the bucket in to debt and then sleeps it
+ * off outside the lock, so the next taker sees the debt and waits
+ * behind it; the limit holds however many workers are copying.
+ */
+struct throttle {
+	pthread_mutex_t lock;
+	int on;
+	double rate[2];       // THROTTLE_BYTES and THROTTLE_OPS per second, 0 unlimited
+	double tokens[2];
+	struct timespec last;
+	const char *path;     // o.throttle_file
+	struct timespec mtime;
+	time_t checked;
+	uint64_t wait_ns;     // summed time spent waiting, updated atomically
+};
+
+/*
+ * An open filecopy(), shared by the threads copying its ranges.
+ */
+struct copyfile {
+	int s;
+	struct stat st;
+	int sparse;
+	int direct;           // source O_DIRECT still on, updated atomically
+	char *source;         // for messages
+	struct unback_sink *k;
+	void *f;              // dest, open on k
+};
+
+/*
+ * A file open on the filesystem sink.  With O_DIRECT, writes that
+ * aren't block aligned go through a bounce buffer padded out to the
+ * block, and the length is put right on close.
+ */
+struct fsfile {
+	int fd;
+	int ddir;             // holds a dircache reference
+	uint64_t size;
+	int direct;           // O_DIRECT still on, updated atomically
+	int padded;
+	char *path;           // for messages
+};
+
+/*
+ * unback_sink_memory(), the output tree as a hash table of paths.
+ * The sink is first so a struct unback_sink * is a struct memsink *.
+ */
+struct memfile {
+	struct memfile *next;
+	char *path;           // in the same allocation
+	int type;             // UNBACK_TYPE_FILE, _DIR, or _OTHER for a link
+	char *data;           // link: the blob name
+	uint64_t size;
+	struct timespec times[2];
+};
+
+struct memsink {
+	struct unback_sink k;
+	pthread_mutex_t lock;
+	struct memfile **tab;
+	uint64_t files;
+	uint64_t bytes;       // updated atomically
+};
+
+/*
+ * A blob of o.chunk_above bytes or more, copied as o.chunk_size
+ * ranges by whichever copy workers are free.  The last range to
+ * complete finishes the file off.
+ */
+struct chunked {
+	pthread_mutex_t lock;
+	struct copyfile cf;
+	struct recbuf *rb;    // the file record
+	char source[SHA1_BLOCK_SIZE * 2 +1];
+	struct timespec times[2], *tp;
+	struct timespec t0;
+	int pending;          // ranges still to complete
+	int failed;
+};
+
+/*
+ * A file record held back by the priority scheduler until the
+ * whole manifest has been decoded.
+ */
+struct sched_entry {
+	struct recbuf *rb;
+	int tier;
+	uint64_t size;
+	uint64_t seq;         // manifest order, keeps the sort stable
+};
+
+/*
+ * With o.memory_budget the plan is an external sort.  Once the
+ * records held pass the budget they are sorted and written out as
+ * a run to a temporary file, and sched_run() merges the runs.
+ */
+struct sched {
+	pthread_mutex_t lock;
+	struct sched_entry *entries;
+	size_t count, size;
+	int fallback_tier;    // for records no rule matches
+	uint64_t seq;
+	uint64_t held;        // bytes of the records in entries
+	FILE **runs;
+	int nruns;
+	int nospill;          // couldn't make a run, carry on in memory
+	size_t next;          // sched_next() position in entries
+	struct sched_entry *heads;  // sched_next() merge, the next entry of each run
+	int (*cmp)( const void *a, const void *b );
+};
+
+/*
+ * A sched_entry in a run, followed by its recbuf.
+ */
+struct spill_head {
+	uint64_t alloc;
+	uint64_t size;
+	uint64_t seq;
+	int32_t tier;
+};
+
+/*
+ * unback_tail() state, an open addressed table of every blob seen
+ * in the manifest or finalised in the backup folder.
+ */
+struct tail_entry {
+	char fileID[SHA1_BLOCK_SIZE * 2 +1];
+	int flags;
+	struct recbuf *rb;    // the latest manifest's record, if it has one
+	ino_t ino;            // the blob as it was when extracted
+	off_t size;
+	struct timespec mtime;
+};
+
+struct tail {
+	pthread_mutex_t lock;      // the table, against the copy workers finishing
+	struct tail_entry *tab;
+	size_t size, used;
+	int ifd;
+	int root_wd;
+	int shard_wd[256];
+	int finished;
+};
+
+/*
+ * State of one unback_extract() call.
+ */
+struct unback_ctx {
+	struct unback *u;
+	struct unback_options o;
+	int output_fd;
+	struct dircache_entry dircache[DIRCACHE_SIZE];
+	uint64_t dircache_clock;
+	pthread_mutex_t dircache_lock;
+	struct timespec start;
+	struct pool pool;
+	struct prefetch pf;
+	struct sched *sched;
+	struct syncer sync;
+	struct throttle th;
+	struct unback_sink fs;   // the filesystem sink, used unless o.sink is set
+	struct unback_sink *sink;
+	struct tail *tail;
+	uint64_t failed;         // FAILED events and records dropped, updated atomically
+};
+
+/*
+ * One rowid range of Manifest.db and the thread decoding it.
+ */
+struct sq3_part {
+	struct unback_ctx *x;
+	sqlite3_int64 lo, hi;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct recbuf *head, *tail;
+	int queued;
+	int done;
+	int local;            // no thread could be started, decoded by the caller
+};
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170301-200110
+  Function Name	: fnv1a
+  Returns Type	: uint64_t
+  ----Parameter List
+  1. const char *s, 
+  2.  int bits , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	FNV-1a of the string s, 64 bit or, with bits 32, the 32 bit
+	variant.  The low 32 bits of the product only depend on the low
+	32 bits going in, so one loop serves both.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static uint64_t fnv1a( const char *s, int bits ) {
+	uint64_t h = (bits == 32) ? 2166136261ULL : 14695981039346656037ULL;
+	uint64_t prime = (bits == 32) ? 16777619ULL : 1099511628211ULL;
+
+	while (*s) h = (h ^ (uint8_t)*s++) * prime;
+
+	return (bits == 32) ? (h & 0xffffffffULL) : h;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170118-220105
+  Function Name	: unback_parse_size
+  Returns Type	: int
+  ----Parameter List
+  1. const char *s, 
+  2.  uint64_t *size , 
+  ------------------
+  Exit Codes	: -1 if s isn't a size
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Bytes, or a count, with an optional K, M or G (powers of 1024).
+	"none" is the same as 0.  Used for the command line sizes and
+	the throttle file alike.
+
+--------------------------------------------------------------------
+Changes:
+	Was parse_size() in ideviceunback.c, and throttle_value().
+
+\------------------------------------------------------------------*/
+int unback_parse_size( const char *s, uint64_t *size ) {
+	char *ep;
+	uint64_t v;
+	int shift = 0;
+
+	if (strcmp(s, "none") == 0) {
+		*size = 0;
+		return 0;
+	}
+	if ((*s < '0')||(*s > '9')) return -1;
+	errno = 0;
+	v = strtoull(s, &ep, 10);
+	if (errno == ERANGE) return -1;
+	switch (*ep) {
+		case 'G': case 'g': shift = 30; ep++; break;
+		case 'M': case 'm': shift = 20; ep++; break;
+		case 'K': case 'k': shift = 10; ep++; break;
+	}
+	if (*ep != '\0') return -1;
+	if (v > (UINT64_MAX >> shift)) return -1;
+	*size = v << shift;
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170215-201020
+  Function Name	: throttle_load
+  Returns Type	: int
+  ----Parameter List
+  1. struct throttle *t , 
+  ------------------
+  Exit Codes	: -1 if the control file couldn't be read
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Re-reads the control file if it has changed since last time,
+	called with t->lock held.  Each line is "bandwidth <bytes>" or
+	"iops <ops>", optionally with an '=' in place of the space.  A
+	limit the file doesn't mention is left as it was.  The buckets
+	of any limit that moves are emptied, so the new one applies
+	from now rather than after the old debt or credit runs out.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int throttle_load( struct throttle *t ) {
+	char line[256], key[32], value[64], *p;
+	struct stat st;
+	uint64_t v;
+	FILE *f;
+	int i;
+
+	if (stat(t->path, &st) == -1) return -1;
+	if ((st.st_mtim.tv_sec == t->mtime.tv_sec)&&(st.st_mtim.tv_nsec == t->mtime.tv_nsec)) return 0;
+	f = fopen(t->path, "r");
+	if (f == NULL) return -1;
+	t->mtime = st.st_mtim;
+
+	while (fgets(line, sizeof(line), f)) {
+		for (p = line; *p; p++) if (*p == '=') *p = ' ';
+		if (sscanf(line, "%31s %63s", key, value) != 2) continue;
+		if (key[0] == '#') continue;
+		if ((strcmp(key, "bandwidth") == 0)||(strcmp(key, "max-bandwidth") == 0)) i = THROTTLE_BYTES;
+		else if ((strcmp(key, "iops") == 0)||(strcmp(key, "max-iops") == 0)) i = THROTTLE_OPS;
+		else i = -1;
+		if ((i == -1)||(unback_parse_size( value, &v ) == -1)) {
+			fprintf(stderr,"Ignoring '%s %s' in throttle file '%s'\n", key, value, t->path);
+			continue;
+		}
+		if (v != t->rate[i]) {
+			t->rate[i] = v;
+			t->tokens[i] = 0;
+		}
+	}
+	fclose(f);
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170215-201030
+  Function Name	: throttle_take
+  Returns Type	: void
+  ----Parameter List
+  1. struct throttle *t, 
+  2.  uint64_t bytes, 
+  3.  int ops , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: sleeps until the limits allow bytes and ops
+  --------------------------------------------------------------------
+Comments:
+	Takes bytes and ops from the buckets, which refill at their
+	rate up to THROTTLE_BURST of a second's worth, and sleeps for
+	however long the larger of the two debts takes to clear.  The
+	control file is looked at no more than once a second.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void throttle_take( struct throttle *t, uint64_t bytes, int ops ) {
+	struct timespec now, ts;
+	double need[2], dt, wait = 0;
+	int i;
+
+	if ((t == NULL)||(!t->on)) return;
+	need[THROTTLE_BYTES] = bytes;
+	need[THROTTLE_OPS] = ops;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&t->lock);
+	if ((t->path)&&(now.tv_sec != t->checked)) {
+		t->checked = now.tv_sec;
+		throttle_load( t );
+	}
+	dt = (now.tv_sec -t->last.tv_sec) + (now.tv_nsec -t->last.tv_nsec) / 1e9;
+	if (dt > 0) t->last = now; // another taker may have got a later time in first
+	else dt = 0;
+	for (i = 0; i < 2; i++) {
+		if (t->rate[i] <= 0) continue;
+		t->tokens[i] += dt * t->rate[i];
+		if (t->tokens[i] > t->rate[i] / THROTTLE_BURST) t->tokens[i] = t->rate[i] / THROTTLE_BURST;
+		t->tokens[i] -= need[i];
+		if ((t->tokens[i] < 0)&&(-t->tokens[i] / t->rate[i] > wait)) wait = -t->tokens[i] / t->rate[i];
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	if (wait > 0) {
+		ts.tv_sec = wait;
+		ts.tv_nsec = (wait -ts.tv_sec) * 1e9;
+		nanosleep(&ts, NULL);
+		__atomic_add_fetch(&t->wait_ns, (uint64_t)(wait * 1e9), __ATOMIC_RELAXED);
+	}
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170222-203010
+  Function Name	: filecopy_open
+  Returns Type	: int
+  ----Parameter List
+  1. int sdir, 
+  2.  char *source, 
+  3.  struct unback_sink *k, 
+  4.  const char *dest, 
+  5.  const struct unback_options *o, 
+  6.  struct copyfile *cf , 
+  ------------------
+  Exit Codes	: -1 if either file couldn't be opened
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	First part of filecopy(), opens source and opens dest on the
+	sink with the size of the source, flagged UNBACK_SINK_SPARSE if
+	the source has holes.
+
+	Sources of o->direct_above bytes or more (if not 0) are read
+	with O_DIRECT, if the filesystem will have it.
+
+--------------------------------------------------------------------
+Changes:
+	Split out of filecopy() so that the ranges of a chunked copy
+	can share the one open.
+
+	Writes through an output sink.
+
+\------------------------------------------------------------------*/
+static int filecopy_open( int sdir, char *source, struct unback_sink *k, const char *dest, const struct unback_options *o, struct copyfile *cf )
+{
+	cf->k = k;
+	cf->source = source;
+	cf->direct = 0;
+
+	cf->s = openat(sdir, source, O_RDONLY);
+	if (cf->s == -1)
+	{
+		fprintf(stderr,"ERROR: Cannot open '%s' for reading (%s).\n", source, strerror(errno) );
+		return -1;
+	}
+
+	if (fstat(cf->s, &cf->st) == -1)
+	{
+		fprintf(stderr,"ERROR: Cannot stat '%s' (%s).\n", source, strerror(errno) );
+		close(cf->s);
+		return -1;
+	}
+
+	if ((o->direct_above)&&((uint64_t)cf->st.st_size >= o->direct_above)&&(fcntl(cf->s, F_SETFL, O_DIRECT) == 0)) {
+		cf->direct = 1;
+	}
+	if ((o->streaming)&&(!cf->direct)) posix_fadvise(cf->s, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	/*
+	 * Fewer allocated blocks than the size needs means the source
+	 * has holes, in which case the sink shouldn't preallocate
+	 */
+	cf->sparse = ((off_t)cf->st.st_blocks * 512 < cf->st.st_size);
+
+	cf->f = k->open_file( k, dest, cf->st.st_size, cf->sparse ? UNBACK_SINK_SPARSE : 0 );
+	if (cf->f == NULL) {
+		close(cf->s);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170222-203020
+  Function Name	: filecopy_range
+  Returns Type	: int
+  ----Parameter List
+  1. struct copyfile *cf, 
+  2.  off_t from, 
+  3.  off_t to, 
+  4.  uint64_t *progress, 
+  5.  const struct unback_options *o, 
+  6.  struct throttle *th , 
+  ------------------
+  Exit Codes	: -1 if the range couldn't be copied in full
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Copies bytes from .. to of an open copy with pread and
+	positioned sink writes, so several threads can each copy a
+	range of the same file at once.  from has to be a multiple of
+	DIRECT_ALIGN.
+
+	Sparse sources are walked extent by extent with
+	SEEK_DATA/SEEK_HOLE so their holes stay holes, and blocks which
+	read back as all zeros are not written at all.
+
+	Bytes are added to *progress (atomically, it is shared by the
+	copy workers) as they are read, if progress is not NULL.  Each
+	read and write is taken from th first, if not NULL.
+
+	With o->streaming the source pages are dropped from the page
+	cache every STREAM_CHUNK bytes.  O_DIRECT falls back to the
+	normal path if the filesystem turns out not to like our
+	alignment.
+
+--------------------------------------------------------------------
+Changes:
+	Split out of filecopy().
+
+	Writes through an output sink, which looks after the dest
+	side of streaming and O_DIRECT.
+
+\------------------------------------------------------------------*/
+static int filecopy_range( struct copyfile *cf, off_t from, off_t to, uint64_t *progress, const struct unback_options *o, struct throttle *th )
+{
+	static __thread char buffer[TOOLS_BLOCK_READ_BUFFER_SIZE]; 
+	char *buf = buffer, *dbuf = NULL;
+	size_t bufsize = TOOLS_BLOCK_READ_BUFFER_SIZE, len;
+	int s = cf->s, sparse = cf->sparse, zero, result = 0;
+	int direct = __atomic_load_n(&cf->direct, __ATOMIC_RELAXED);
+	off_t off, data, hole, dropped = from;
+	ssize_t rsize = 0;
+
+	if (direct) {
+		if (posix_memalign((void **)&dbuf, DIRECT_ALIGN, DIRECT_BUFFER_SIZE) != 0) {
+			fprintf(stderr,"ERROR: Cannot allocate a buffer to copy '%s' (%s).\n", cf->source, strerror(errno) );
+			return -1;
+		}
+		buf = dbuf;
+		bufsize = DIRECT_BUFFER_SIZE;
+	}
+
+	off = from;
+	while (off < to) {
+		data = off;
+		hole = to;
+		if (sparse) {
+			data = lseek(s, off, SEEK_DATA);
+			if ((data == -1)&&(errno == ENXIO)) break; // only a hole left
+			if (data == -1) {
+				data = off; // no SEEK_DATA support, copy the rest in full
+				sparse = 0;
+			} else if (data >= to) {
+				break;
+			} else {
+				hole = lseek(s, data, SEEK_HOLE);
+				if ((hole == -1)||(hole > to)) hole = to;
+			}
+		}
+		if (direct) data &= ~(off_t)(DIRECT_ALIGN -1);
+
+		for (off = data; off < hole; off += rsize) {
+			len = bufsize;
+			if ((off_t)len > hole -off) len = hole -off; // don't fill in the next hole
+			if (direct) len = (len +DIRECT_ALIGN -1) & ~(size_t)(DIRECT_ALIGN -1);
+			throttle_take( th, len, 1 );
+			rsize = pread( s, buf, len, off );
+			if ((rsize == -1)&&(direct)&&(errno == EINVAL)) {
+				// misaligned for this filesystem after all
+				fcntl(s, F_SETFL, 0);
+				__atomic_store_n(&cf->direct, 0, __ATOMIC_RELAXED);
+				direct = 0;
+				rsize = pread( s, buf, len, off );
+			}
+			if (rsize <= 0) break;
+			if (progress) __atomic_add_fetch(progress, rsize, __ATOMIC_RELAXED);
+
+			zero = ((buf[0] == 0)&&(memcmp(buf, buf +1, rsize -1) == 0));
+			if (!zero) {
+				throttle_take( th, 0, 1 );
+				if (cf->k->write( cf->k, cf->f, buf, rsize, off ) == -1) {
+					result = -1;
+					break;
+				}
+			}
+
+			if ((o->streaming)&&(!direct)&&(off +rsize -dropped >= STREAM_CHUNK)) {
+				posix_fadvise(s, dropped, off +rsize -dropped, POSIX_FADV_DONTNEED);
+				dropped = off +rsize;
+			}
+		}
+		if (rsize < 0) {
+			fprintf(stderr,"ERROR: Cannot read '%s' (%s).\n", cf->source, strerror(errno) );
+			result = -1;
+		}
+		if ((rsize <= 0)||(result == -1)) break;
+	}
+
+	free(dbuf);
+
+	return result;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170222-203030
+  Function Name	: filecopy_close
+  Returns Type	: int
+  ----Parameter List
+  1. struct copyfile *cf, 
+  2.  struct timespec *times, 
+  3.  const struct unback_options *o, 
+  4.  int failed , 
+  ------------------
+  Exit Codes	: -1 if dest couldn't be closed
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Last part of filecopy(), once every range is copied, or failed
+	is set.  If times is not NULL they are handed to the sink for
+	the access and modification times of dest.
+
+--------------------------------------------------------------------
+Changes:
+	Split out of filecopy().
+
+	Durability moved in to the filesystem sink.
+
+\------------------------------------------------------------------*/
+static int filecopy_close( struct copyfile *cf, struct timespec *times, const struct unback_options *o, int failed )
+{
+	if (o->streaming) posix_fadvise(cf->s, 0, 0, POSIX_FADV_DONTNEED);
+	close(cf->s);
+
+	return cf->k->close( cf->k, cf->f, times, failed );
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20160928-010850
+  Function Name	: filecopy
+  Returns Type	: int
+  ----Parameter List
+  1. int sdir, 
+  2.  char *source, 
+  3.  struct unback_sink *k, 
+  4.  const char *dest, 
+  5.  struct timespec *times, 
+  6.  uint64_t *progress, 
+  7.  const struct unback_options *o, 
+  8.  struct throttle *th , 
+  ------------------
+  Exit Codes	: -1 if dest couldn't be written in full
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	source is a name relative to the open directory descriptor
+	sdir, dest a path relative to the root of the sink k.  See
+	filecopy_open(), filecopy_range() and filecopy_close() for the
+	rest.
+
+--------------------------------------------------------------------
+Changes:
+	Switched from stdio on full paths to openat() on cached
+	directory descriptors.
+
+	Preallocation and sparse aware copying.
+
+	Per thread buffer and progress counting for the copy workers.
+
+	Streaming and O_DIRECT modes.
+
+	Write, fsync and close errors are returned rather than ignored.
+
+	Bandwidth and IOPS throttling.
+
+	Split in to open, range and close steps for chunked copies.
+
+	Writes through an output sink rather than to a directory
+	descriptor.
+
+\------------------------------------------------------------------*/
+static int filecopy( int sdir, char *source, struct unback_sink *k, const char *dest, struct timespec *times, uint64_t *progress, const struct unback_options *o, struct throttle *th )
+{
+	struct copyfile cf;
+	int result;
+
+	if (filecopy_open( sdir, source, k, dest, o, &cf ) == -1) return -1;
+	result = filecopy_range( &cf, 0, cf.st.st_size, progress, o, th );
+	if (filecopy_close( &cf, times, o, result != 0 ) == -1) result = -1;
+
+	return result;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20160928-010845
+  Function Name	: mkdirp
+  Returns Type	: int
+  ----Parameter List
+  1. char *path, 
+  2.  int mode , 
+  ------------------
+  Exit Codes	: -1 if a folder couldn't be made
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	On failure errno says why, and path is left as it was.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int mkdirp( char *path, int mode )
+{
+	int result = 0;
+	char c = '/';
+	char *p = path;
+
+	if (*p == '/') p++;
+
+	while ((p != NULL)&&(*p != '\0'))
+	{
+		struct stat st;
+		int stat_result;
+
+		p = strchr(p,'/');
+		if (p != NULL)
+		{
+			while (*(p+1) == '/') p++;
+			c = *p;
+			*p = '\0';
+		}
+
+		stat_result = stat(path, &st);
+		if ((stat_result == 0)&&(S_ISDIR(st.st_mode)||S_ISLNK(st.st_mode)))
+		{
+			// If the link is good, then do nothing
+		} else if (stat_result == -1) {
+			int mkresult=0;
+
+			mkresult = mkdir(path,mode);
+			if ((mkresult != 0)&&(errno != EEXIST)) // another host may have just made it
+			{
+				int e = errno;
+				fprintf(stderr,"ERROR: while attempting mkdir('%s'); '%s'\n",path,strerror(e));
+				if (p != NULL) *p = c;
+				errno = e;
+				return -1;
+			}
+		} else {
+			fprintf(stderr,"ERROR: path %s seems to already exist as a non-directory\n",path);
+			if (p != NULL) *p = c;
+			errno = ENOTDIR;
+			return -1;
+		}
+
+		if (p != NULL)
+		{
+			*p = c; p++;
+		}
+
+	}
+
+	return result;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170125-204510
+  Function Name	: syncer_thread
+  Returns Type	: void *
+  ----Parameter List
+  1. void *arg , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	The copies started their writeback with sync_file_range(), so
+	by the time a batch is taken most of it is already on disk and
+	the fsync()s mostly wait on metadata.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void *syncer_thread( void *arg ) {
+	struct syncer *sy = arg;
+	int batch[SYNC_MAX_FDS];
+	int i, n;
+
+	pthread_mutex_lock(&sy->lock);
+	for (;;) {
+		while ((sy->count < (sy->max +1) / 2)&&(sy->bytes < SYNC_BATCH_BYTES)&&(!sy->done)) {
+			pthread_cond_wait(&sy->cond, &sy->lock);
+		}
+		if ((sy->done)&&(sy->count == 0)) break;
+
+		n = sy->count;
+		memcpy(batch, sy->fds, n * sizeof(int));
+		sy->count = 0;
+		sy->bytes = 0;
+		pthread_mutex_unlock(&sy->lock);
+
+		for (i = 0; i < n; i++) {
+			if ((fsync(batch[i]) == -1)||(close(batch[i]) == -1)) {
+				fprintf(stderr,"ERROR: Cannot sync output (%s)\n", strerror(errno));
+				__atomic_add_fetch(&sy->errors, 1, __ATOMIC_RELAXED);
+			}
+		}
+
+		pthread_mutex_lock(&sy->lock);
+		sy->held -= n;
+		pthread_cond_broadcast(&sy->space);
+	}
+	pthread_mutex_unlock(&sy->lock);
+
+	return NULL;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170125-204520
+  Function Name	: syncer_push
+  Returns Type	: void
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  int fd , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: takes over fd, blocks while the syncer holds its most
+  --------------------------------------------------------------------
+Comments:
+	Without the syncer running fd is just closed.  Reaching the cap
+	has the queue synced straight away rather than waiting for a
+	full batch.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void syncer_push( struct unback_ctx *x, int fd ) {
+	struct syncer *sy = &x->sync;
+	struct stat st;
+
+	if (!sy->running) {
+		close(fd);
+		return;
+	}
+
+	if ((fstat(fd, &st) == -1)||(!S_ISREG(st.st_mode))) st.st_size = 0;
+
+	pthread_mutex_lock(&sy->lock);
+	while (sy->held >= sy->max) {
+		if (sy->count) pthread_cond_signal(&sy->cond);
+		pthread_cond_wait(&sy->space, &sy->lock);
+	}
+	sy->fds[sy->count++] = fd;
+	sy->held++;
+	sy->bytes += st.st_size;
+	if ((sy->count >= (sy->max +1) / 2)||(sy->held >= sy->max)||(sy->bytes >= SYNC_BATCH_BYTES)) pthread_cond_signal(&sy->cond);
+	pthread_mutex_unlock(&sy->lock);
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170125-204530
+  Function Name	: syncer_start
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x , 
+  ------------------
+  Exit Codes	: -1 if the thread couldn't be started, or there's no fd to spare
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	The cap on held fds is whatever RLIMIT_NOFILE leaves after the
+	shard folders, the directory cache and two per copy worker, up
+	to SYNC_MAX_FDS.  Without the syncer the files are just closed
+	and syncer_finish()'s syncfs() does the lot.
+
+--------------------------------------------------------------------
+Changes:
+	Sized from RLIMIT_NOFILE.
+
+\------------------------------------------------------------------*/
+static int syncer_start( struct unback_ctx *x ) {
+	struct syncer *sy = &x->sync;
+	struct rlimit rl;
+	long room = 1024;
+
+	if ((getrlimit(RLIMIT_NOFILE, &rl) == 0)&&(rl.rlim_cur != RLIM_INFINITY)) room = rl.rlim_cur;
+	room -= 256 +DIRCACHE_SIZE +x->pool.nthreads * 2 +PREFETCH_THREADS +SYNC_FD_SPARE;
+	sy->max = (room > SYNC_MAX_FDS) ? SYNC_MAX_FDS : room;
+	if (sy->max < 1) {
+		fprintf(stderr,"Too few file descriptors to sync in the background, syncing once at the end\n");
+		return -1;
+	}
+
+	pthread_mutex_init(&sy->lock, NULL);
+	pthread_cond_init(&sy->cond, NULL);
+	pthread_cond_init(&sy->space, NULL);
+	if (pthread_create(&sy->thread, NULL, syncer_thread, sy) != 0) {
+		pthread_mutex_destroy(&sy->lock);
+		pthread_cond_destroy(&sy->cond);
+		pthread_cond_destroy(&sy->space);
+		return -1;
+	}
+	sy->running = 1;
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170125-204540
+  Function Name	: syncer_finish
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x , 
+  ------------------
+  Exit Codes	: -1 if anything failed to reach the disk
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Syncs what is still queued, then the whole output filesystem
+	with syncfs() and lastly the output root itself, whose entry
+	the directory cache never hands over.  The directory cache must
+	have been flushed first.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int syncer_finish( struct unback_ctx *x ) {
+	struct syncer *sy = &x->sync;
+
+	if (sy->running) {
+		pthread_mutex_lock(&sy->lock);
+		sy->done = 1;
+		pthread_cond_signal(&sy->cond);
+		pthread_mutex_unlock(&sy->lock);
+		pthread_join(sy->thread, NULL);
+		pthread_mutex_destroy(&sy->lock);
+		pthread_cond_destroy(&sy->cond);
+		pthread_cond_destroy(&sy->space);
+		sy->running = 0;
+	}
+
+	if (syncfs(x->output_fd) == -1) {
+		fprintf(stderr,"ERROR: Cannot sync the output filesystem (%s)\n", strerror(errno));
+		sy->errors++;
+	}
+	if (fsync(x->output_fd) == -1) {
+		fprintf(stderr,"ERROR: Cannot sync the output path (%s)\n", strerror(errno));
+		sy->errors++;
+	}
+
+	return sy->errors ? -1 : 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170125-204550
+  Function Name	: dir_close
+  Returns Type	: void
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  int fd , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Closes an output directory, first making its entries durable
+	when asked to.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void dir_close( struct unback_ctx *x, int fd ) {
+
+	if (x->o.durability == UNBACK_DURABILITY_BATCH) {
+		syncer_push( x, fd );
+		return;
+	}
+	if ((x->o.durability == UNBACK_DURABILITY_FILE)&&(fsync(fd) == -1)) {
+		fprintf(stderr,"ERROR: Cannot sync output directory (%s)\n", strerror(errno));
+		__atomic_add_fetch(&x->sync.errors, 1, __ATOMIC_RELAXED);
+	}
+	close(fd);
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20160928-010848
+  Function Name	: dircache_unref
+  Returns Type	: void
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  int fd , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: closes fd if it was handed out uncached
+  --------------------------------------------------------------------
+Comments:
+	Caller holds x->dircache_lock.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void dircache_unref( struct unback_ctx *x, int fd )
+{
+	int i;
+
+	if ((fd == -1)||(fd == x->output_fd)) return;
+
+	for (i = 0; i < DIRCACHE_SIZE; i++) {
+		if ((x->dircache[i].path)&&(x->dircache[i].fd == fd)) {
+			x->dircache[i].refs--;
+			return;
+		}
+	}
+	dir_close( x, fd );
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20160928-010846
+  Function Name	: dircache_lookup
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  char *path , 
+  ------------------
+  Exit Codes	: -1 on failure
+  Side Effects	: may close the least recently used cached descriptor
+  --------------------------------------------------------------------
+Comments:
+	Returns an open descriptor for the directory 'path', relative
+	to the output root, creating it (and any missing parents) as
+	required.  Parents are resolved through the cache as well, so
+	only the components which are not already open get walked.
+
+	Caller holds x->dircache_lock.  A reference is taken on the
+	returned descriptor, drop it with dircache_unref().  Entries
+	still referenced by a copy worker are never evicted; if every
+	entry is busy the descriptor is handed out uncached and closed
+	again by dircache_unref().
+
+--------------------------------------------------------------------
+Changes:
+	Used instead of mkdirp() per file, which stat()'d every
+	component from the root each time.
+
+	Reference counted for the copy workers.
+
+\------------------------------------------------------------------*/
+static int dircache_lookup( struct unback_ctx *x, char *path )
+{
+	struct dircache_entry *e, *victim;
+	char *name;
+	int i, parent, fd;
+
+	if (*path == '\0') return x->output_fd;
+
+	for (i = 0; i < DIRCACHE_SIZE; i++) {
+		e = &x->dircache[i];
+		if ((e->path) && (strcmp(e->path, path) == 0)) {
+			e->used = ++x->dircache_clock;
+			e->refs++;
+			return e->fd;
+		}
+	}
+
+	name = strrchr(path, '/');
+	if (name) {
+		*name = '\0';
+		parent = dircache_lookup( x, path );
+		*name = '/';
+		name++;
+	} else {
+		parent = x->output_fd;
+		name = path;
+	}
+	if (parent == -1) return -1;
+	if ((*name == '\0')||(strcmp(name, ".") == 0)) return parent;
+
+	fd = openat(parent, name, O_RDONLY|O_DIRECTORY);
+	if ((fd == -1)&&(errno == ENOENT)) {
+		if ((mkdirat(parent, name, S_IRWXU) != 0)&&(errno != EEXIST)) {
+			fprintf(stderr,"ERROR: while attempting mkdir('%s'); '%s'\n", path, strerror(errno));
+			dircache_unref( x, parent );
+			return -1;
+		}
+		if (x->o.durability == UNBACK_DURABILITY_FILE) fsync(parent);
+		fd = openat(parent, name, O_RDONLY|O_DIRECTORY);
+	}
+	if (fd == -1) {
+		if (errno == ENOTDIR) {
+			fprintf(stderr,"ERROR: path %s seems to already exist as a non-directory\n", path);
+		} else {
+			fprintf(stderr,"ERROR: Cannot open directory '%s' (%s)\n", path, strerror(errno));
+		}
+		dircache_unref( x, parent );
+		return -1;
+	}
+	dircache_unref( x, parent );
+
+	victim = NULL;
+	for (i = 0; i < DIRCACHE_SIZE; i++) {
+		e = &x->dircache[i];
+		if (e->path == NULL) { victim = e; break; }
+		if ((e->refs == 0)&&((victim == NULL)||(e->used < victim->used))) victim = e;
+	}
+	if (victim == NULL) return fd;
+	if (victim->path) {
+		dir_close( x, victim->fd );
+		free(victim->path);
+	}
+	victim->path = strdup(path);
+	victim->fd = fd;
+	victim->refs = 1;
+	victim->used = ++x->dircache_clock;
+
+	return fd;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20160928-010849
+  Function Name	: dircache_get
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  char *path , 
+  ------------------
+  Exit Codes	: -1 on failure
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Locked wrappers around dircache_lookup() / dircache_unref(),
+	every dircache_get() needs a matching dircache_put().
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int dircache_get( struct unback_ctx *x, char *path )
+{
+	int fd;
+
+	pthread_mutex_lock(&x->dircache_lock);
+	fd = dircache_lookup( x, path );
+	pthread_mutex_unlock(&x->dircache_lock);
+
+	return fd;
+}
+
+static void dircache_put( struct unback_ctx *x, int fd )
+{
+	pthread_mutex_lock(&x->dircache_lock);
+	dircache_unref( x, fd );
+	pthread_mutex_unlock(&x->dircache_lock);
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20160928-010847
+  Function Name	: dircache_flush
+  Returns Type	: void
+  ----Parameter List
+  1. struct unback_ctx *x , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: closes every cached directory descriptor
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void dircache_flush( struct unback_ctx *x )
+{
+	int i;
+
+	for (i = 0; i < DIRCACHE_SIZE; i++) {
+		if (x->dircache[i].path) {
+			dir_close( x, x->dircache[i].fd );
+			free(x->dircache[i].path);
+			x->dircache[i].path = NULL;
+		}
+	}
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20160928-010856
+  Function Name	: *splitpath
+  Returns Type	: char
+  ----Parameter List
+  1. char *fullpath , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static char *splitpath( char *fullpath ) {
+	char *p;
+
+	if (fullpath) {
+		p = strrchr(fullpath, '/');
+		if (p) {
+			*p = '\0';
+			p++;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170301-200010
+  Function Name	: fs_begin_dir
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_sink *k, 
+  2.  const char *path , 
+  ------------------
+  Exit Codes	: -1 if the directory couldn't be made
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	The filesystem sink, writing under o.outputpath.  Directories
+	are made by fs_open_file() and fs_link() as they look the
+	parent up in the directory cache, so there is nothing to do
+	here; a second lookup would only double the cache scan.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int fs_begin_dir( struct unback_sink *k, const char *path ) {
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170301-200020
+  Function Name	: fs_open_file
+  Returns Type	: void *
+  ----Parameter List
+  1. struct unback_sink *k, 
+  2.  const char *path, 
+  3.  uint64_t size, 
+  4.  int flags , 
+  ------------------
+  Exit Codes	: NULL if path couldn't be created
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Creates path, and any missing parents, and preallocates it to
+	size to keep it contiguous.  UNBACK_SINK_SPARSE files just get their length, so
+	their holes stay holes.  Files of o.direct_above bytes or more
+	(if not 0) are written with O_DIRECT where the filesystem will
+	have it.
+
+--------------------------------------------------------------------
+Changes:
+	Was the dest half of filecopy_open().
+
+\------------------------------------------------------------------*/
+static void *fs_open_file( struct unback_sink *k, const char *path, uint64_t size, int flags ) {
+	struct unback_ctx *x = k->arg;
+	struct fsfile *f;
+	char buf[PATH_MAX], *fn;
+
+	f = calloc(1, sizeof(struct fsfile));
+	if (f == NULL) return NULL;
+	f->path = strdup(path);
+	f->size = size;
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	fn = splitpath(buf);
+	if (fn) {
+		f->ddir = dircache_get( x, buf );
+	} else {
+		fn = buf;
+		f->ddir = x->output_fd;
+	}
+	f->fd = -1;
+	if ((f->ddir != -1)&&(f->path)) {
+		f->fd = openat(f->ddir, fn, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+		if (f->fd == -1) fprintf(stderr,"ERROR: Cannot open '%s' for writing (%s).\n", path, strerror(errno) );
+	}
+	if (f->fd == -1) {
+		dircache_put( x, f->ddir );
+		free(f->path);
+		free(f);
+		return NULL;
+	}
+
+	if ((x->o.direct_above)&&(size >= x->o.direct_above)&&(fcntl(f->fd, F_SETFL, O_DIRECT) == 0)) f->direct = 1;
+	if (size > 0) {
+		ftruncate(f->fd, size);
+		if (!(flags & UNBACK_SINK_SPARSE)) fallocate(f->fd, FALLOC_FL_KEEP_SIZE, 0, size);
+	}
+
+	return f;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170301-200030
+  Function Name	: fs_write
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_sink *k, 
+  2.  void *file, 
+  3.  const void *buf, 
+  4.  size_t len, 
+  5.  uint64_t off , 
+  ------------------
+  Exit Codes	: -1 if len bytes couldn't be written
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	pwrite() at off, safe for several threads writing ranges of the
+	same file.
+
+	O_DIRECT writes which aren't block aligned are padded out in a
+	bounce buffer (the length is put right on close), or go through
+	the page cache if off itself is misaligned.
+
+	With o.streaming, whenever a write crosses a STREAM_CHUNK
+	boundary writeback of the chunk behind it is started, and the
+	chunk before that is waited on and dropped from the page cache.
+	Being worked out from the offset alone it needs no state, so
+	ranges being written at once don't get in each other's way.
+
+--------------------------------------------------------------------
+Changes:
+	Was the write half of filecopy_range().
+
+\------------------------------------------------------------------*/
+static int fs_write( struct unback_sink *k, void *file, const void *buf, size_t len, uint64_t off ) {
+	struct unback_ctx *x = k->arg;
+	struct fsfile *f = file;
+	const char *p = buf;
+	char *bounce = NULL;
+	size_t wlen = len;
+	ssize_t wsize;
+	off_t b;
+	int direct;
+
+	direct = __atomic_load_n(&f->direct, __ATOMIC_RELAXED);
+	if ((direct)&&(off & (DIRECT_ALIGN -1))) {
+		fcntl(f->fd, F_SETFL, 0);
+		__atomic_store_n(&f->direct, 0, __ATOMIC_RELAXED);
+		direct = 0;
+	}
+	if ((direct)&&((len | (uintptr_t)buf) & (DIRECT_ALIGN -1))) {
+		wlen = (len +DIRECT_ALIGN -1) & ~(size_t)(DIRECT_ALIGN -1);
+		if (posix_memalign((void **)&bounce, DIRECT_ALIGN, wlen) == 0) {
+			memcpy(bounce, buf, len);
+			memset(bounce +len, 0, wlen -len);
+			p = bounce;
+			f->padded = 1;
+		} else {
+			wlen = len;
+		}
+	}
+
+	wsize = pwrite( f->fd, p, wlen, off );
+	if ((wsize == -1)&&(direct)&&(errno == EINVAL)) {
+		// misaligned for this filesystem after all
+		fcntl(f->fd, F_SETFL, 0);
+		__atomic_store_n(&f->direct, 0, __ATOMIC_RELAXED);
+		direct = 0;
+		wsize = pwrite( f->fd, buf, len, off );
+	}
+	free(bounce);
+	if ((wsize == -1)||((size_t)wsize < len)) {
+		fprintf(stderr,"ERROR: Read '%lu' bytes, but only could write '%ld' to '%s' (%s)\n", len, wsize, f->path, wsize == -1 ? strerror(errno) : "short write" );
+		return -1;
+	}
+
+	b = (off +len) / STREAM_CHUNK * STREAM_CHUNK;
+	if ((x->o.streaming)&&(!direct)&&(b > (off_t)off)&&(b >= STREAM_CHUNK)) {
+		sync_file_range(f->fd, b -STREAM_CHUNK, STREAM_CHUNK, SYNC_FILE_RANGE_WRITE);
+		if (b >= 2 * STREAM_CHUNK) {
+			sync_file_range(f->fd, b -2 * STREAM_CHUNK, STREAM_CHUNK, SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(f->fd, b -2 * STREAM_CHUNK, STREAM_CHUNK, POSIX_FADV_DONTNEED);
+		}
+	}
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170301-200040
+  Function Name	: fs_close
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_sink *k, 
+  2.  void *file, 
+  3.  const struct timespec *times, 
+  4.  int failed , 
+  ------------------
+  Exit Codes	: -1 if the file couldn't be synced or closed
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Sets the times and applies o.durability.  With
+	UNBACK_DURABILITY_FILE the file and its directory are
+	fsync()'d before returning.  With UNBACK_DURABILITY_BATCH its
+	writeback is started and it is handed to the syncer still open,
+	unless the copy failed.
+
+--------------------------------------------------------------------
+Changes:
+	Was filecopy_close() and the durability part of unback_blob().
+
+\------------------------------------------------------------------*/
+static int fs_close( struct unback_sink *k, void *file, const struct timespec *times, int failed ) {
+	struct unback_ctx *x = k->arg;
+	struct fsfile *f = file;
+	int result = 0;
+
+	if (f->padded) ftruncate(f->fd, f->size);
+
+	if (x->o.streaming) {
+		sync_file_range(f->fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(f->fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+
+	if (times) futimens(f->fd, times);
+
+	if (x->o.durability == UNBACK_DURABILITY_FILE) {
+		if (fsync(f->fd) == -1) {
+			fprintf(stderr,"ERROR: Cannot fsync '%s' (%s).\n", f->path, strerror(errno) );
+			result = -1;
+		}
+	} else if ((x->o.durability == UNBACK_DURABILITY_BATCH)&&(!x->o.streaming)) {
+		sync_file_range(f->fd, 0, 0, SYNC_FILE_RANGE_WRITE); // write-behind, the syncer waits on it
+	}
+
+	if ((x->sync.running)&&(result == 0)&&(!failed)) {
+		syncer_push( x, f->fd );
+	} else if (close(f->fd) == -1) {
+		fprintf(stderr,"ERROR: Cannot close '%s' (%s).\n", f->path, strerror(errno) );
+		result = -1;
+	}
+	if ((result == 0)&&(!failed)&&(x->o.durability == UNBACK_DURABILITY_FILE)&&(fsync(f->ddir) == -1)) result = -1;
+
+	dircache_put( x, f->ddir );
+	free(f->path);
+	free(f);
+
+	return result;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170301-200050
+  Function Name	: fs_link
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_sink *k, 
+  2.  const char *path, 
+  3.  int sdir, 
+  4.  const char *blob , 
+  ------------------
+  Exit Codes	: -1 if the link couldn't be made
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Hard links path to the blob, for -l.
+
+--------------------------------------------------------------------
+Changes:
+	Was the link part of unback_blob().
+
+\------------------------------------------------------------------*/
+static int fs_link( struct unback_sink *k, const char *path, int sdir, const char *blob ) {
+	struct unback_ctx *x = k->arg;
+	char buf[PATH_MAX], *fn;
+	int ddir, result;
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	fn = splitpath(buf);
+	if (fn) {
+		ddir = dircache_get( x, buf );
+	} else {
+		fn = buf;
+		ddir = x->output_fd;
+	}
+	if (ddir == -1) return -1;
+
+	result = linkat( sdir, blob, ddir, fn, 0 );
+	if ((result == 0)&&(x->o.durability == UNBACK_DURABILITY_FILE)&&(fsync(ddir) == -1)) result = -1;
+	dircache_put( x, ddir );
+
+	return result;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170301-200110
+  Function Name	: null_begin_dir
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_sink *k, 
+  2.  const char *path , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	The null sink; everything succeeds and nothing is kept, so an
+	extraction only measures the read side.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int null_begin_dir( struct unback_sink *k, const char *path ) {
+	return 0;
+}
+
+static void *null_open_file( struct unback_sink *k, const char *path, uint64_t size, int flags ) {
+	return k;
+}
+
+static int null_write( struct unback_sink *k, void *file, const void *buf, size_t len, uint64_t off ) {
+	return 0;
+}
+
+static int null_close( struct unback_sink *k, void *file, const struct timespec *times, int failed ) {
+	return 0;
+}
+
+static int null_link( struct unback_sink *k, const char *path, int sdir, const char *blob ) {
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170301-200120
+  Function Name	: memsink_add
+  Returns Type	: struct memfile *
+  ----Parameter List
+  1. struct memsink *m, 
+  2.  const char *path, 
+  3.  int type , 
+  ------------------
+  Exit Codes	: NULL when out of memory
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	The memory sink keeps the output tree in a hash table of
+	paths, 64 bit FNV-1a in to MEMSINK_BUCKETS chains.
+
+	Adds an entry for path at the head of its chain, so it hides
+	any earlier one; earlier entries are not freed as another
+	thread may still be writing them.  Directories are only added
+	once.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static struct memfile *memsink_add( struct memsink *m, const char *path, int type ) {
+	struct memfile *f;
+	uint64_t h = fnv1a( path, 64 ) % MEMSINK_BUCKETS;
+
+	pthread_mutex_lock(&m->lock);
+	if (type == UNBACK_TYPE_DIR) {
+		for (f = m->tab[h]; f; f = f->next) {
+			if ((f->type == UNBACK_TYPE_DIR)&&(strcmp(f->path, path) == 0)) {
+				pthread_mutex_unlock(&m->lock);
+				return f;
+			}
+		}
+	}
+	f = calloc(1, sizeof(struct memfile) +strlen(path) +1);
+	if (f) {
+		f->path = (char *)(f +1);
+		strcpy(f->path, path);
+		f->type = type;
+		f->next = m->tab[h];
+		m->tab[h] = f;
+		if (type != UNBACK_TYPE_DIR) m->files++;
+	}
+	pthread_mutex_unlock(&m->lock);
+
+	return f;
+}
+
+static int memsink_begin_dir( struct unback_sink *k, const char *path ) {
+	return memsink_add( (struct memsink *)k, path, UNBACK_TYPE_DIR ) ? 0 : -1;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170301-200130
+  Function Name	: memsink_open_file
+  Returns Type	: void *
+  ----Parameter List
+  1. struct unback_sink *k, 
+  2.  const char *path, 
+  3.  uint64_t size, 
+  4.  int flags , 
+  ------------------
+  Exit Codes	: NULL when out of memory
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	The whole file is allocated up front, zeroed so holes read
+	back as zeros.  Writes past size fail rather than reallocate
+	underneath the other ranges.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void *memsink_open_file( struct unback_sink *k, const char *path, uint64_t size, int flags ) {
+	struct memsink *m = (struct memsink *)k;
+	struct memfile *f;
+	char *data;
+
+	data = calloc(1, size ? size : 1);
+	if (data == NULL) {
+		fprintf(stderr,"ERROR: Cannot hold '%s' in memory, %lu bytes.\n", path, size );
+		return NULL;
+	}
+	f = memsink_add( m, path, UNBACK_TYPE_FILE );
+	if (f == NULL) {
+		free(data);
+		return NULL;
+	}
+	f->data = data;
+	f->size = size;
+	__atomic_add_fetch(&m->bytes, size, __ATOMIC_RELAXED);
+
+	return f;
+}
+
+static int memsink_write( struct unback_sink *k, void *file, const void *buf, size_t len, uint64_t off ) {
+	struct memfile *f = file;
+
+	if (off +len > f->size) {
+		fprintf(stderr,"ERROR: '%s' grew past %lu bytes whilst being copied.\n", f->path, f->size );
+		return -1;
+	}
+	memcpy(f->data +off, buf, len);
+
+	return 0;
+}
+
+static int memsink_close( struct unback_sink *k, void *file, const struct timespec *times, int failed ) {
+	struct memfile *f = file;
+
+	if (times) {
+		f->times[0] = times[0];
+		f->times[1] = times[1];
+	}
+
+	return 0;
+}
+
+static int memsink_link( struct unback_sink *k, const char *path, int sdir, const char *blob ) {
+	struct memfile *f;
+
+	f = memsink_add( (struct memsink *)k, path, UNBACK_TYPE_OTHER );
+	if (f == NULL) return -1;
+	f->data = strdup(blob);
+
+	return f->data ? 0 : -1;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170301-200140
+  Function Name	: unback_sink_null
+  Returns Type	: struct unback_sink *
+  ----Parameter List
+  1. void , 
+  ------------------
+  Exit Codes	: NULL when out of memory
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Constructors for the built in sinks, free them with
+	unback_sink_free() once the extraction is done.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+struct unback_sink *unback_sink_null( void ) {
+	struct unback_sink *k;
+
+	k = calloc(1, sizeof(struct unback_sink));
+	if (k == NULL) return NULL;
+	k->begin_dir = null_begin_dir;
+	k->open_file = null_open_file;
+	k->write = null_write;
+	k->close = null_close;
+	k->link = null_link;
+
+	return k;
+}
+
+struct unback_sink *unback_sink_memory( void ) {
+	struct memsink *m;
+
+	m = calloc(1, sizeof(struct memsink));
+	if (m == NULL) return NULL;
+	m->tab = calloc(MEMSINK_BUCKETS, sizeof(struct memfile *));
+	if (m->tab == NULL) {
+		free(m);
+		return NULL;
+	}
+	pthread_mutex_init(&m->lock, NULL);
+	m->k.begin_dir = memsink_begin_dir;
+	m->k.open_file = memsink_open_file;
+	m->k.write = memsink_write;
+	m->k.close = memsink_close;
+	m->k.link = memsink_link;
+	m->k.arg = m;
+
+	return &m->k;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170301-200150
+  Function Name	: unback_sink_memory_get
+  Returns Type	: const void *
+  ----Parameter List
+  1. struct unback_sink *k, 
+  2.  const char *path, 
+  3.  uint64_t *size , 
+  ------------------
+  Exit Codes	: NULL if the memory sink has no file at path
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Contents of the latest file written at path, and its length
+	in *size.  For a linked file it is the blob name instead.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+const void *unback_sink_memory_get( struct unback_sink *k, const char *path, uint64_t *size ) {
+	struct memsink *m = (struct memsink *)k;
+	struct memfile *f;
+	uint64_t h = fnv1a( path, 64 ) % MEMSINK_BUCKETS;
+
+	pthread_mutex_lock(&m->lock);
+	for (f = m->tab[h]; f; f = f->next) {
+		if ((f->type != UNBACK_TYPE_DIR)&&(strcmp(f->path, path) == 0)) break;
+	}
+	pthread_mutex_unlock(&m->lock);
+	if (f == NULL) return NULL;
+	if (size) *size = (f->type == UNBACK_TYPE_FILE) ? f->size : strlen(f->data);
+
+	return f->data;
+}
+
+void unback_sink_memory_usage( struct unback_sink *k, uint64_t *files, uint64_t *bytes ) {
+	struct memsink *m = (struct memsink *)k;
+
+	pthread_mutex_lock(&m->lock);
+	*files = m->files;
+	*bytes = __atomic_load_n(&m->bytes, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&m->lock);
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170301-200160
+  Function Name	: unback_sink_free
+  Returns Type	: void
+  ----Parameter List
+  1. struct unback_sink *k , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Frees a sink from unback_sink_null() or unback_sink_memory(),
+	along with everything the memory sink holds.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+void unback_sink_free( struct unback_sink *k ) {
+	struct memsink *m;
+	struct memfile *f;
+	size_t i;
+
+	if (k == NULL) return;
+	if (k->write == memsink_write) {
+		m = (struct memsink *)k;
+		for (i = 0; i < MEMSINK_BUCKETS; i++) {
+			while ((f = m->tab[i])) {
+				m->tab[i] = f->next;
+				free(f->data);
+				free(f);
+			}
+		}
+		free(m->tab);
+		pthread_mutex_destroy(&m->lock);
+	}
+	free(k);
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20160928-010908
+  Function Name	: readuint8
+  Returns Type	: int
+  ----Parameter List
+  1. char **p, 
+  2.  uint8_t *i , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int readuint8( char **p, uint8_t *i ) {
+	*i = **p;
+
+	(*p)++;
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20160928-010913
+  Function Name	: readuint16
+  Returns Type	: int
+  ----Parameter List
+  1. char **p, 
+  2.  uint16_t *i , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int readuint16( char **p, uint16_t *i ) {
+	uint16_t a = 0;
+
+	memcpy(&a, *p, sizeof(uint16_t));
+	*i = (((a & 0x00FF) <<  8) | ((a & 0xFF00) >>  8));
+	(*p) += 2;
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20160928-010915
+  Function Name	: readuint32
+  Returns Type	: int
+  ----Parameter List
+  1. char **p, 
+  2.  uint32_t *i , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int readuint32( char **p, uint32_t *i ) {
+	uint32_t a = 0;
+
+	memcpy(&a, *p, sizeof(uint32_t));
+	*i = (
+			((a & 0x000000FFUL) << 24) | 
+			((a & 0x0000FF00UL) <<  8) | 
+			((a & 0x00FF0000UL) >>  8) | 
+			((a & 0xFF000000UL) >> 24) 
+		 );
+	(*p) += 4;
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20160928-010918
+  Function Name	: readuint64
+  Returns Type	: int
+  ----Parameter List
+  1. char **p, 
+  2.  uint64_t *i , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int readuint64( char **p, uint64_t *i ) {
+
+	uint64_t a = 0;
+
+	memcpy(&a, *p, sizeof(uint64_t));
+	*i = ((a & 0x00000000000000FFULL) << 56) | 
+		((a & 0x000000000000FF00ULL) << 40) | 
+		((a & 0x0000000000FF0000ULL) << 24) | 
+		((a & 0x00000000FF000000ULL) <<  8) | 
+		((a & 0x000000FF00000000ULL) >>  8) | 
+		((a & 0x0000FF0000000000ULL) >> 24) | 
+		((a & 0x00FF000000000000ULL) >> 40) | 
+		((a & 0xFF00000000000000ULL) >> 56);
+	(*p) += 8;
+	return 0;
+}
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170201-211010
+  Function Name	: manifest_detect
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback *u , 
+  ------------------
+  Exit Codes	: -1 if there's no manifest (yet)
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Works out which manifest type the backup holds, Manifest.mbdb
+	being preferred.
+
+--------------------------------------------------------------------
+Changes:
+	Split out of unback_open().
+
+\------------------------------------------------------------------*/
+static int manifest_detect( struct unback *u ) {
+	struct stat statbuf;
+
+	snprintf(u->manifest_filename, sizeof(u->manifest_filename),"%s/Manifest.mbdb", u->inputpath);
+	if (stat( u->manifest_filename, &statbuf ) == 0) {
+		u->manifest_type = UNBACK_MANIFEST_MBDB;
+		return 0;
+	}
+
+	snprintf(u->manifest_filename, sizeof(u->manifest_filename),"%s/Manifest.db", u->inputpath);
+	if (stat( u->manifest_filename, &statbuf ) == 0) {
+		u->manifest_type = UNBACK_MANIFEST_SQL;
+		return 0;
+	}
+
+	return -1;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170201-211020
+  Function Name	: unback_open_live
+  Returns Type	: struct unback *
+  ----Parameter List
+  1. const char *inputpath , 
+  ------------------
+  Exit Codes	: NULL if inputpath can't be opened
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Opens a backup folder which may still be being written, the
+	manifest type stays UNBACK_MANIFEST_NONE until one turns up.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+struct unback *unback_open_live( const char *inputpath ) {
+	struct unback *u;
+	int i;
+
+	u = calloc(1, sizeof(struct unback));
+	if (u == NULL) return NULL;
+	u->inputpath = strdup(inputpath);
+	u->manifest_type = UNBACK_MANIFEST_NONE;
+	for (i = 0; i < 256; i++) u->shard_fd[i] = -1;
+	pthread_mutex_init(&u->shard_lock, NULL);
+
+	/*
+	 * Keep the input root open, everything below it is then
+	 * resolved relative to this descriptor.
+	 */
+	u->input_fd = open(inputpath, O_RDONLY|O_DIRECTORY);
+	if (u->input_fd == -1) {
+		fprintf(stderr,"Cannot open input path '%s' (%s)\n", inputpath, strerror(errno));
+		unback_close(u);
+		return NULL;
+	}
+	manifest_detect( u );
+
+	return u;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131230
+  Function Name	: unback_open
+  Returns Type	: struct unback *
+  ----Parameter List
+  1. const char *inputpath , 
+  ------------------
+  Exit Codes	: NULL if there's no usable manifest
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Opens the backup folder and works out which manifest type it
+	holds.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+struct unback *unback_open( const char *inputpath ) {
+	struct unback *u;
+
+	u = unback_open_live( inputpath );
+	if ((u)&&(u->manifest_type == UNBACK_MANIFEST_NONE)) {
+		fprintf(stderr,"Could not load SQLite3 (iOS 10+) manifest (%s)\n", u->manifest_filename);
+		unback_close(u);
+		return NULL;
+	}
+
+	return u;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131231
+  Function Name	: unback_close
+  Returns Type	: void
+  ----Parameter List
+  1. struct unback *u , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Every cursor and extraction on u must have finished.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+void unback_close( struct unback *u ) {
+	int i;
+
+	if (u == NULL) return;
+	for (i = 0; i < 256; i++) if (u->shard_fd[i] >= 0) close(u->shard_fd[i]);
+	if (u->input_fd != -1) close(u->input_fd);
+	pthread_mutex_destroy(&u->shard_lock);
+	free(u->inputpath);
+	free(u);
+}
+
+int unback_manifest_type( struct unback *u ) {
+	return u->manifest_type;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131239
+  Function Name	: shard_index
+  Returns Type	: int
+  ----Parameter List
+  1. const char *name , 
+  ------------------
+  Exit Codes	: -1 if name doesn't start with two lower case hex digits
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Which of the 256 shard folders a fileID, or a shard folder's
+	own name, refers to.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int shard_index( const char *name ) {
+	static char hexdigits[] = "0123456789abcdef";
+	char *h, *l;
+
+	if ((name[0] == '\0')||(name[1] == '\0')) return -1;
+	h = strchr(hexdigits, name[0]);
+	l = strchr(hexdigits, name[1]);
+	if ((h == NULL)||(l == NULL)) return -1;
+
+	return ((h -hexdigits) << 4) | (l -hexdigits);
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131240
+  Function Name	: input_dirfd
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback *u, 
+  2.  const char *fileID , 
+  ------------------
+  Exit Codes	: -1 if the blob's directory doesn't exist
+  Side Effects	: opens the shard directory on first use
+  --------------------------------------------------------------------
+Comments:
+	Returns the directory descriptor holding the blob for fileID.
+	Pre iOS10 backups keep every blob in the top level folder,
+	later ones split them over 256 shard folders named after the
+	first two hex digits of the fileID.
+
+	Safe to call from several threads.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int input_dirfd( struct unback *u, const char *fileID ) {
+	char shardname[3];
+	int shard, fd;
+
+	if (u->manifest_type == UNBACK_MANIFEST_MBDB) return u->input_fd;
+
+	shard = shard_index( fileID );
+	if (shard == -1) return -1;
+
+	fd = __atomic_load_n(&u->shard_fd[shard], __ATOMIC_ACQUIRE);
+	if (fd == -1) {
+		pthread_mutex_lock(&u->shard_lock);
+		fd = u->shard_fd[shard];
+		if (fd == -1) {
+			snprintf(shardname, sizeof(shardname), "%c%c", fileID[0], fileID[1]);
+			fd = openat(u->input_fd, shardname, O_RDONLY|O_DIRECTORY);
+			if (fd == -1) fd = -2; // don't retry missing shards
+			__atomic_store_n(&u->shard_fd[shard], fd, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&u->shard_lock);
+	}
+
+	return fd < 0 ? -1 : fd;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20160928-010902
+  Function Name	: readstr
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_cursor *c, 
+  2.  struct unback_string *s , 
+  ------------------
+  Exit Codes	: -1 if the string runs past the end of the manifest
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Reads a big endian length prefixed mbdb string, 0xffff being
+	an empty one.  s is left pointing in to the mmap()'d manifest.
+
+--------------------------------------------------------------------
+Changes:
+	No longer copies (and squashes the multibyte UTF8 sequences
+	of) the string, the raw bytes are what the fileID hash covers.
+
+\------------------------------------------------------------------*/
+static int readstr( struct unback_cursor *c, struct unback_string *s ) {
+	size_t sl;
+
+	if (c->ep -c->p < 2) return -1;
+	if (((uint8_t)c->p[0] == 0xff)&&((uint8_t)c->p[1] == 0xff)) {
+		s->s = "";
+		s->len = 0;
+		c->p += 2;
+		return 0;
+	}
+	sl = ((uint8_t)c->p[0] << 8) + (uint8_t)c->p[1];
+	c->p += 2;
+	if ((size_t)(c->ep -c->p) < sl) return -1;
+
+	s->s = c->p;
+	s->len = sl;
+	c->p += sl;
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131244
+  Function Name	: mbdb_next
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_cursor *c, 
+  2.  struct unback_record *r , 
+  ------------------
+  Exit Codes	: 1 record, 0 end of manifest, -1 corrupt
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Decodes the next Manifest.mbdb record and computes its fileID,
+	the SHA1 of domain-path.
+
+--------------------------------------------------------------------
+Changes:
+	Was the body of manifest_pre10_decode().
+
+\------------------------------------------------------------------*/
+static int mbdb_next( struct unback_cursor *c, struct unback_record *r ) {
+	SHA1_CTX ctx;
+	uint8_t hash[SHA1_BLOCK_SIZE];
+	struct unback_string name, value;
+	int i;
+
+	if (c->p >= c->ep) return 0;
+	memset(r, 0, sizeof(struct unback_record));
+
+	if ((readstr(c, &r->domain))
+			|| (readstr(c, &r->path))
+			|| (readstr(c, &r->target)) // absolute path for symlinks
+			|| (readstr(c, &r->digest))
+			|| (readstr(c, &r->enckey))
+			|| (c->ep -c->p < MBDB_RECORD_FIXED)) {
+		goto corrupt;
+	}
+
+	readuint16(&c->p, &r->mode); // mode
+	readuint64(&c->p, &r->inode); // inode#
+	readuint32(&c->p, &r->uid); // uid
+	readuint32(&c->p, &r->gid); // gid
+	readuint32(&c->p, &r->mtime); // last modified time
+	readuint32(&c->p, &r->atime); // last accessed time
+	readuint32(&c->p, &r->ctime); // created time
+	readuint64(&c->p, &r->size); // size
+	readuint8(&c->p, &r->protection); // protection class
+	readuint8(&c->p, &r->numprops); // number of properties
+
+	r->props = c->p;
+	for (i = 0 ; i < r->numprops; i++) {
+		if ((readstr(c, &name))||(readstr(c, &value))) goto corrupt;
+	}
+
+	/*
+	 * Compute the SHA1 hash for the manifest item
+	 */
+	sha1_init(&ctx);
+	sha1_update(&ctx, (const uint8_t *)r->domain.s, r->domain.len);
+	sha1_update(&ctx, (const uint8_t *)"-", 1);
+	sha1_update(&ctx, (const uint8_t *)r->path.s, r->path.len);
+	sha1_final(&ctx, hash);
+	for (i=0; i < SHA1_BLOCK_SIZE; i++) {
+		sprintf(c->fileID+(i*2),"%02hhx",hash[i]);
+	}
+	r->fileID.s = c->fileID;
+	r->fileID.len = SHA1_BLOCK_SIZE * 2;
+
+	switch (r->mode & 0xE000) {
+		case 0x8000: r->type = UNBACK_TYPE_FILE; break;
+		case 0x4000: r->type = UNBACK_TYPE_DIR; break;
+		case 0xA000: r->type = UNBACK_TYPE_SYMLINK; break;
+		default: r->type = UNBACK_TYPE_OTHER;
+	}
+
+	return 1;
+
+corrupt:
+	fprintf(stderr,"'%s' is truncated or corrupt at offset %ld\n", c->u->manifest_filename, (long)(c->p -c->addr));
+	c->p = c->ep;
+	return -1;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-132159
+  Function Name	: sq3_next
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_cursor *c, 
+  2.  struct unback_record *r , 
+  ------------------
+  Exit Codes	: 1 record, 0 end of manifest, -1 error
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Steps to the next Manifest.db row.  flags 1 is a file, 2 a
+	directory and 4 a symlink.
+
+--------------------------------------------------------------------
+Changes:
+	Was sq3_callback(), for sqlite3_exec().
+
+\------------------------------------------------------------------*/
+static int sq3_next( struct unback_cursor *c, struct unback_record *r ) {
+	struct unback_string *col[3];
+	int rc, i;
+
+	rc = sqlite3_step(c->stmt);
+	if (rc == SQLITE_DONE) return 0;
+	if (rc != SQLITE_ROW) {
+		fprintf(stderr,"SQL Error: %s\n", sqlite3_errmsg(c->db));
+		return -1;
+	}
+
+	memset(r, 0, sizeof(struct unback_record));
+	col[0] = &r->fileID;
+	col[1] = &r->domain;
+	col[2] = &r->path;
+	for (i = 0; i < 3; i++) {
+		col[i]->s = (const char *)sqlite3_column_text(c->stmt, i);
+		col[i]->len = sqlite3_column_bytes(c->stmt, i);
+		if (col[i]->s == NULL) { col[i]->s = ""; col[i]->len = 0; }
+	}
+	r->target.s = r->digest.s = r->enckey.s = r->file.s = "";
+	if (c->flags & UNBACK_CURSOR_FILEBLOB) {
+		r->file.s = sqlite3_column_blob(c->stmt, 4);
+		r->file.len = sqlite3_column_bytes(c->stmt, 4);
+		if (r->file.s == NULL) r->file.s = "";
+	}
+
+	switch (sqlite3_column_int(c->stmt, 3)) {
+		case 1: r->type = UNBACK_TYPE_FILE; break;
+		case 2: r->type = UNBACK_TYPE_DIR; break;
+		case 4: r->type = UNBACK_TYPE_SYMLINK; break;
+		default: r->type = UNBACK_TYPE_OTHER;
+	}
+
+	return 1;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131245
+  Function Name	: cursor_open_range
+  Returns Type	: struct unback_cursor *
+  ----Parameter List
+  1. struct unback *u, 
+  2.  int flags, 
+  3.  int ranged, 
+  4.  sqlite3_int64 lo, 
+  5.  sqlite3_int64 hi , 
+  ------------------
+  Exit Codes	: NULL on failure
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	With 'ranged' set only the Manifest.db rows with rowid from
+	lo to hi are read.  Each cursor has its own read only SQLite
+	connection, so cursors can be used from different threads.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static struct unback_cursor *cursor_open_range( struct unback *u, int flags, int ranged, sqlite3_int64 lo, sqlite3_int64 hi ) {
+	struct unback_cursor *c;
+	struct stat sb;
+	char sql[1024];
+	int rc;
+
+	c = calloc(1, sizeof(struct unback_cursor));
+	if (c == NULL) return NULL;
+	c->u = u;
+	c->flags = flags;
+	c->fd = -1;
+
+	if (u->manifest_type == UNBACK_MANIFEST_MBDB) {
+		c->fd = open(u->manifest_filename, O_RDONLY);
+		if (c->fd == -1) {
+			fprintf(stderr,"Cannot open '%s' for reading (%s)\n", u->manifest_filename, strerror(errno));
+			goto fail;
+		}
+
+		/*
+		 * Get manifest filesize so we can mmap the whole file 
+		 */
+		if (fstat(c->fd, &sb) == -1)  {
+			fprintf(stderr,"Cannot stat '%s' (%s)\n", u->manifest_filename, strerror(errno));
+			goto fail;
+		}
+
+		/*
+		 * Attempt to mmap the file
+		 */
+		c->size = sb.st_size;
+		c->addr = mmap(NULL, c->size, PROT_READ, MAP_PRIVATE, c->fd, 0);
+		if (c->addr == MAP_FAILED) {
+			c->addr = NULL;
+			fprintf(stderr,"Cannot mmap '%s' (%s)\n", u->manifest_filename, strerror(errno));
+			goto fail;
+		}
+
+		/*
+		 * Verify the Manifest file
+		 */
+		if ((c->size < 6)||(memcmp(c->addr, "mbdb", 4))) {
+			fprintf(stderr,"\"%s\" does not appear to be a folder containing a valid Manifest.mbdb file\n", u->inputpath);
+			goto fail;
+		}
+		c->p = c->addr +6; // jump the header
+		c->ep = c->addr +c->size;
+		return c;
+	}
+
+	rc = sqlite3_open_v2( u->manifest_filename, &c->db, SQLITE_OPEN_READONLY|SQLITE_OPEN_NOMUTEX, NULL );
+	if ( rc ) {
+		fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(c->db));
+		goto fail;
+	}
+
+	snprintf(sql, sizeof(sql), "SELECT fileID, domain, relativePath, flags%s from Files%s;"
+			, (flags & UNBACK_CURSOR_FILEBLOB) ? ", file" : ""
+			, ranged ? " WHERE rowid BETWEEN ?1 AND ?2" : ""
+			);
+	rc = sqlite3_prepare_v2( c->db, sql, -1, &c->stmt, NULL );
+	if ( rc != SQLITE_OK ) {
+		fprintf(stderr,"SQL Error: %s\n", sqlite3_errmsg(c->db));
+		goto fail;
+	}
+	if (ranged) {
+		sqlite3_bind_int64(c->stmt, 1, lo);
+		sqlite3_bind_int64(c->stmt, 2, hi);
+	}
+
+	return c;
+
+fail:
+	unback_cursor_close(c);
+	return NULL;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131246
+  Function Name	: unback_cursor_open
+  Returns Type	: struct unback_cursor *
+  ----Parameter List
+  1. struct unback *u, 
+  2.  int flags , 
+  ------------------
+  Exit Codes	: NULL on failure
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Iterates every record of the manifest in order;
+
+		c = unback_cursor_open(u, 0);
+		while (unback_cursor_next(c, &r) == 1) { ... }
+		unback_cursor_close(c);
+
+	The strings in each record point in to the manifest and are
+	replaced by the next call to unback_cursor_next().
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+struct unback_cursor *unback_cursor_open( struct unback *u, int flags ) {
+	return cursor_open_range( u, flags, 0, 0, 0 );
+}
+
+int unback_cursor_next( struct unback_cursor *c, struct unback_record *r ) {
+	if (c->u->manifest_type == UNBACK_MANIFEST_MBDB) return mbdb_next( c, r );
+	return sq3_next( c, r );
+}
+
+void unback_cursor_close( struct unback_cursor *c ) {
+	if (c == NULL) return;
+	if (c->stmt) sqlite3_finalize(c->stmt);
+	if (c->db) sqlite3_close(c->db);
+	if (c->addr) munmap(c->addr, c->size);
+	if (c->fd != -1) close(c->fd);
+	free(c);
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131247
+  Function Name	: unback_record_prop
+  Returns Type	: int
+  ----Parameter List
+  1. const struct unback_record *r, 
+  2.  int i, 
+  3.  struct unback_string *name, 
+  4.  struct unback_string *value , 
+  ------------------
+  Exit Codes	: -1 if there's no property i
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Fetches the i'th name=value property of an mbdb record.  Only
+	valid on records straight from a cursor, the copies handed to
+	the copy workers don't keep their properties.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int unback_record_prop( const struct unback_record *r, int i, struct unback_string *name, struct unback_string *value ) {
+	const uint8_t *p = (const uint8_t *)r->props;
+	struct unback_string *s[2];
+	int n, k;
+
+	if ((i < 0)||(i >= r->numprops)||(p == NULL)) return -1;
+
+	s[0] = name;
+	s[1] = value;
+	for (n = 0; n <= i; n++) {
+		for (k = 0; k < 2; k++) {
+			if ((p[0] == 0xff)&&(p[1] == 0xff)) {
+				s[k]->s = "";
+				s[k]->len = 0;
+				p += 2;
+			} else {
+				s[k]->len = (p[0] << 8) + p[1];
+				s[k]->s = (const char *)p +2;
+				p += 2 +s[k]->len;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131248
+  Function Name	: unback_blob_path
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback *u, 
+  2.  const struct unback_record *r, 
+  3.  char *buf, 
+  4.  size_t len , 
+  ------------------
+  Exit Codes	: -1 if buf is too small
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Full path of the blob holding a file record's contents.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int unback_blob_path( struct unback *u, const struct unback_record *r, char *buf, size_t len ) {
+	int n;
+
+	if (u->manifest_type == UNBACK_MANIFEST_MBDB) {
+		n = snprintf(buf, len, "%s/%s", u->inputpath, r->fileID.s);
+	} else {
+		n = snprintf(buf, len, "%s/%.2s/%s", u->inputpath, r->fileID.s, r->fileID.s);
+	}
+
+	return ((n < 0)||((size_t)n >= len)) ? -1 : 0;
+}
+
+int unback_blob_stat( struct unback *u, const struct unback_record *r, struct stat *st ) {
+	int sdir;
+
+	sdir = input_dirfd( u, r->fileID.s );
+	if (sdir == -1) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	return fstatat( sdir, r->fileID.s, st, 0 );
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131241
+  Function Name	: unback_shard_of
+  Returns Type	: int
+  ----Parameter List
+  1. const char *fileID, 
+  2.  int count , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Maps a blob name on to one of 'count' shards.  The blob name is
+	the SHA1 of domain-path for both manifest types, hashed here with
+	32 bit FNV-1a so every host computes the same partitioning.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int unback_shard_of( const char *fileID, int count ) {
+
+	if (count <= 1) return 0;
+
+	return fnv1a( fileID, 32 ) % count;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131249
+  Function Name	: recbuf_dup
+  Returns Type	: struct recbuf *
+  ----Parameter List
+  1. const struct unback_record *r , 
+  ------------------
+  Exit Codes	: NULL when out of memory
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Copies a cursor record, and its strings, so it can be queued.
+	The copied strings are all NUL terminated.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static struct recbuf *recbuf_dup( const struct unback_record *r ) {
+	struct recbuf *rb;
+	const struct unback_string *from[7];
+	struct unback_string *to[7];
+	size_t total = 0;
+	char *p;
+	int i;
+
+	from[0] = &r->fileID;
+	from[1] = &r->domain;
+	from[2] = &r->path;
+	from[3] = &r->target;
+	from[4] = &r->digest;
+	from[5] = &r->enckey;
+	from[6] = &r->file;
+	for (i = 0; i < 7; i++) total += from[i]->len +1;
+
+	rb = malloc(sizeof(struct recbuf) +total);
+	if (rb == NULL) return NULL;
+	rb->next = NULL;
+	rb->alloc = sizeof(struct recbuf) +total;
+	rb->chunk = NULL;
+	rb->r = *r;
+	rb->r.props = NULL;
+	rb->r.numprops = 0;
+
+	to[0] = &rb->r.fileID;
+	to[1] = &rb->r.domain;
+	to[2] = &rb->r.path;
+	to[3] = &rb->r.target;
+	to[4] = &rb->r.digest;
+	to[5] = &rb->r.enckey;
+	to[6] = &rb->r.file;
+	p = (char *)(rb +1);
+	for (i = 0; i < 7; i++) {
+		memcpy(p, from[i]->s, from[i]->len);
+		p[from[i]->len] = '\0';
+		to[i]->s = p;
+		p += from[i]->len +1;
+	}
+
+	return rb;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170308-201000
+  Function Name	: recbuf_relink
+  Returns Type	: void
+  ----Parameter List
+  1. struct recbuf *rb , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Points the strings of a recbuf read back from a sort run at
+	its own copies, which follow the struct in the order
+	recbuf_dup() laid them out.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void recbuf_relink( struct recbuf *rb ) {
+	struct unback_string *to[7];
+	char *p;
+	int i;
+
+	to[0] = &rb->r.fileID;
+	to[1] = &rb->r.domain;
+	to[2] = &rb->r.path;
+	to[3] = &rb->r.target;
+	to[4] = &rb->r.digest;
+	to[5] = &rb->r.enckey;
+	to[6] = &rb->r.file;
+	p = (char *)(rb +1);
+	for (i = 0; i < 7; i++) {
+		to[i]->s = p;
+		p += to[i]->len +1;
+	}
+	rb->r.props = NULL;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170201-212010
+  Function Name	: tail_find
+  Returns Type	: struct tail_entry *
+  ----Parameter List
+  1. struct tail *t, 
+  2.  const char *fileID, 
+  3.  int create , 
+  ------------------
+  Exit Codes	: NULL if fileID isn't there (or out of memory)
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Linear probing on a 64 bit FNV-1a of the fileID, the table is
+	kept under half full.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static struct tail_entry *tail_find( struct tail *t, const char *fileID, int create ) {
+	struct tail_entry *tab, *e;
+	uint64_t h;
+	size_t i, n;
+
+	if ((create)&&((t->used +1) * 2 > t->size)) {
+		n = t->size ? t->size * 2 : 4096;
+		tab = calloc(n, sizeof(struct tail_entry));
+		if (tab == NULL) return NULL;
+		for (i = 0; i < t->size; i++) {
+			if (t->tab[i].fileID[0] == '\0') continue;
+			h = fnv1a( t->tab[i].fileID, 64 );
+			for (e = &tab[h & (n -1)]; e->fileID[0]; e = &tab[(e -tab +1) & (n -1)]);
+			*e = t->tab[i];
+		}
+		free(t->tab);
+		t->tab = tab;
+		t->size = n;
+	}
+	if (t->size == 0) return NULL;
+
+	h = fnv1a( fileID, 64 );
+	for (e = &t->tab[h & (t->size -1)]; e->fileID[0]; e = &t->tab[(e -t->tab +1) & (t->size -1)]) {
+		if (strcmp(e->fileID, fileID) == 0) return e;
+	}
+	if (!create) return NULL;
+
+	snprintf(e->fileID, sizeof(e->fileID), "%s", fileID);
+	t->used++;
+
+	return e;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170201-212015
+  Function Name	: tail_done
+  Returns Type	: void
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  const struct unback_record *r, 
+  3.  int event , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	A copy started by tail_copy() has finished, the blob only counts
+	as extracted once it has been copied or linked.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void tail_done( struct unback_ctx *x, const struct unback_record *r, int event ) {
+	struct tail *t = x->tail;
+	struct tail_entry *e;
+
+	pthread_mutex_lock(&t->lock);
+	e = tail_find( t, r->fileID.s, 0 );
+	if ((e)&&(e->flags & TAIL_COPYING)) {
+		e->flags &= ~TAIL_COPYING;
+		if ((event == UNBACK_EVENT_COPIED)||(event == UNBACK_EVENT_LINKED)) e->flags |= TAIL_DONE;
+	}
+	pthread_mutex_unlock(&t->lock);
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170222-204010
+  Function Name	: blob_done
+  Returns Type	: void
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  const struct unback_record *r, 
+  3.  int event, 
+  4.  struct timespec *t0 , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Counts a finished copy, started at t0, and reports it.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void blob_done( struct unback_ctx *x, const struct unback_record *r, int event, struct timespec *t0 ) {
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	__atomic_add_fetch(&x->pool.files, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&x->pool.latency_ns, (t1.tv_sec -t0->tv_sec) * 1000000000ULL +t1.tv_nsec -t0->tv_nsec, __ATOMIC_RELAXED);
+
+	if (event == UNBACK_EVENT_FAILED) __atomic_add_fetch(&x->failed, 1, __ATOMIC_RELAXED);
+	if (x->tail) tail_done( x, r, event );
+	if (x->o.event) x->o.event( x->o.arg, event, r );
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170222-204020
+  Function Name	: chunk_done
+  Returns Type	: void
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  struct chunked *c, 
+  3.  int result , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: frees c after its last range
+  --------------------------------------------------------------------
+Comments:
+	Marks one range of c complete.  Whichever thread completes the
+	last one closes the file off and reports it.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void chunk_done( struct unback_ctx *x, struct chunked *c, int result ) {
+	int last;
+
+	pthread_mutex_lock(&c->lock);
+	if (result != 0) c->failed = 1;
+	last = (--c->pending == 0);
+	pthread_mutex_unlock(&c->lock);
+	if (!last) return;
+
+	if (filecopy_close( &c->cf, c->tp, &x->o, c->failed ) == -1) c->failed = 1;
+	blob_done( x, &c->rb->r, c->failed ? UNBACK_EVENT_FAILED : UNBACK_EVENT_COPIED, &c->t0 );
+
+	pthread_mutex_destroy(&c->lock);
+	free(c->rb);
+	free(c);
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170222-204030
+  Function Name	: chunk_copy
+  Returns Type	: void
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  struct recbuf *job , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Copy worker side of a chunked copy, one o.chunk_size range.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void chunk_copy( struct unback_ctx *x, struct recbuf *job ) {
+	struct chunked *c = job->chunk;
+	off_t to;
+
+	to = job->off +(off_t)x->o.chunk_size;
+	if (to > c->cf.st.st_size) to = c->cf.st.st_size;
+	chunk_done( x, c, filecopy_range( &c->cf, job->off, to, &x->pool.bytes, &x->o, &x->th ) );
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170222-204040
+  Function Name	: chunk_start
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  const struct unback_record *r, 
+  3.  int sdir, 
+  4.  const char *dest, 
+  5.  struct timespec *tp, 
+  6.  struct timespec *t0 , 
+  ------------------
+  Exit Codes	: -1 if the copy couldn't be started
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Opens dest on the sink, then queues a job for each
+	o.chunk_size range at the front of the copy queue, so the free
+	workers pick the big file up ahead of anything else and it
+	doesn't end up as a long tail on one thread.  The queue limit
+	is ignored here, a worker waiting for space in its own queue
+	would never get any.
+
+	If the range jobs can't be allocated the file is copied here in
+	one go instead.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int chunk_start( struct unback_ctx *x, const struct unback_record *r, int sdir, const char *dest, struct timespec *tp, struct timespec *t0 ) {
+	struct pool *p = &x->pool;
+	struct chunked *c;
+	struct recbuf *job, *head = NULL, *tail = NULL;
+	off_t off;
+	int n = 0;
+
+	c = calloc(1, sizeof(struct chunked));
+	if (c == NULL) return -1;
+	c->rb = recbuf_dup( r );
+	snprintf(c->source, sizeof(c->source), "%s", r->fileID.s);
+	if ((c->rb == NULL)||(filecopy_open( sdir, c->source, x->sink, dest, &x->o, &c->cf ) == -1)) {
+		free(c->rb);
+		free(c);
+		return -1;
+	}
+	pthread_mutex_init(&c->lock, NULL);
+	c->t0 = *t0;
+	if (tp) {
+		c->times[0] = tp[0];
+		c->times[1] = tp[1];
+		c->tp = c->times;
+	}
+
+	for (off = 0; off < c->cf.st.st_size; off += x->o.chunk_size) {
+		job = calloc(1, sizeof(struct recbuf));
+		if (job == NULL) break;
+		job->chunk = c;
+		job->off = off;
+		if (tail) tail->next = job; else head = job;
+		tail = job;
+		n++;
+	}
+
+	if ((n == 0)||(off < c->cf.st.st_size)) {
+		while ((job = head)) {
+			head = job->next;
+			free(job);
+		}
+		c->pending = 1;
+		chunk_done( x, c, filecopy_range( &c->cf, 0, c->cf.st.st_size, &p->bytes, &x->o, &x->th ) );
+		return 0;
+	}
+
+	c->pending = n;
+	pthread_mutex_lock(&p->lock);
+	tail->next = p->head;
+	p->head = head;
+	if (p->tail == NULL) p->tail = tail;
+	p->queued += n;
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->lock);
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131242
+  Function Name	: unback_blob
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  const struct unback_record *r , 
+  ------------------
+  Exit Codes	: -1 if the copy failed
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Copies or links the blob of file record r to its path on the
+	output sink, then reports the outcome through the event
+	callback.  Called inline by the decoders, or from the copy
+	workers.
+
+	With copy workers, blobs of o.chunk_above bytes or more are
+	handed to chunk_start() and reported once all their ranges
+	are copied.
+
+--------------------------------------------------------------------
+Changes:
+	Reports through the event callback rather than stdout.
+
+	Chunked copies of large blobs.
+
+	Writes through x->sink.
+
+\------------------------------------------------------------------*/
+static int unback_blob( struct unback_ctx *x, const struct unback_record *r ) {
+	struct unback_sink *k = x->sink;
+	char path[PATH_MAX];
+	char *fn;
+	int sdir, event, result = 0;
+	struct timespec t0, times[2], *tp = NULL;
+	struct stat st;
+
+	sdir = input_dirfd( x->u, r->fileID.s );
+	if ((sdir == -1)||(faccessat( sdir, r->fileID.s, F_OK, 0 ) == -1)) {
+		if (x->o.event) x->o.event( x->o.arg, UNBACK_EVENT_MISSING, r );
+		return 0;
+	}
+
+	if (x->u->manifest_type == UNBACK_MANIFEST_MBDB) {
+		times[0].tv_sec = r->atime; times[0].tv_nsec = 0;
+		times[1].tv_sec = r->mtime; times[1].tv_nsec = 0;
+		tp = times;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	event = UNBACK_EVENT_FOUND;
+	if (x->o.decode_only == 0) {
+		snprintf(path, sizeof(path), "%.*s", (int)r->path.len, r->path.s);
+		fn = strrchr(path, '/');
+		if (fn) {
+			*fn = '\0';
+			result = k->begin_dir( k, path );
+			*fn = '/';
+		}
+		if (result == -1) {
+			// parent couldn't be made
+		} else if (x->o.linkonly) {
+			throttle_take( &x->th, 0, 1 );
+			result = k->link( k, path, sdir, r->fileID.s );
+			event = UNBACK_EVENT_LINKED;
+		} else if ((x->o.chunk_above)&&(x->pool.nthreads)
+				&&(fstatat( sdir, r->fileID.s, &st, 0 ) == 0)&&((uint64_t)st.st_size >= x->o.chunk_above)) {
+			if (chunk_start( x, r, sdir, path, tp, &t0 ) == 0) return 0; // reported by the last range
+			result = -1;
+		} else {
+			result = filecopy( sdir, (char *)r->fileID.s, k, path, tp, &x->pool.bytes, &x->o, &x->th );
+			event = UNBACK_EVENT_COPIED;
+		}
+		if (result != 0) event = UNBACK_EVENT_FAILED;
+	}
+	blob_done( x, r, event, &t0 );
+
+	return result;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131250
+  Function Name	: pool_worker
+  Returns Type	: void *
+  ----Parameter List
+  1. void *arg , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Copy worker thread.  Only takes a job while fewer than
+	pool.limit workers are busy, so the controller can raise or
+	lower the concurrency without starting or stopping threads.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void *pool_worker( void *arg ) {
+	struct unback_ctx *x = arg;
+	struct pool *p = &x->pool;
+	struct recbuf *job;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (((p->head == NULL)||(p->active >= p->limit))&&(!((p->done)&&(p->head == NULL)))) {
+			pthread_cond_wait(&p->work, &p->lock);
+		}
+		if (p->head == NULL) {
+			pthread_cond_broadcast(&p->work); // the other idle workers may have missed done
+			break;
+		}
+
+		job = p->head;
+		p->head = job->next;
+		if (p->head == NULL) p->tail = NULL;
+		p->queued--;
+		p->queued_bytes -= job->alloc;
+		p->active++;
+		pthread_cond_signal(&p->space);
+		pthread_mutex_unlock(&p->lock);
+
+		if (job->chunk) chunk_copy( x, job );
+		else unback_blob( x, &job->r );
+		free(job);
+
+		pthread_mutex_lock(&p->lock);
+		p->active--;
+		pthread_cond_signal(&p->work);
+		if ((p->active == 0)&&(p->head == NULL)) pthread_cond_broadcast(&p->idle);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131251
+  Function Name	: pool_tune
+  Returns Type	: void
+  ----Parameter List
+  1. struct pool *p, 
+  2.  double score, 
+  3.  double latency, 
+  4.  double size , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: changes p->limit
+  --------------------------------------------------------------------
+Comments:
+	One hill climbing step for UNBACK_JOBS_AUTO, called with
+	p->lock held.
+
+	score is the throughput of the last window, counting each file
+	as POOL_AUTO_OP_BYTES on top of its bytes so that small file
+	phases (bound by per file latency) and large file phases (bound
+	by bandwidth) are both measured sensibly.  Whilst the score
+	improves the limit keeps moving the same way with a doubling
+	step, when it drops the direction reverses and the step halves.
+	A flat score with rising per file latency means extra workers
+	are only queueing, so the limit backs off.
+
+	When the mean file size of the window moves by more than 4x
+	the workload has changed phase, and the climb restarts.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void pool_tune( struct pool *p, double score, double latency, double size ) {
+	int limit = p->limit;
+
+	if ((p->tune_size > 0)&&((size > p->tune_size * 4)||(size * 4 < p->tune_size))) {
+		p->tune_score = 0;
+		p->tune_dir = 1;
+		p->tune_step = limit / 2 > 1 ? limit / 2 : 1;
+	}
+
+	if (score > p->tune_score * 1.05) {
+		if (p->tune_step < 16) p->tune_step *= 2;
+	} else if (score < p->tune_score * 0.95) {
+		p->tune_dir = -p->tune_dir;
+		if (p->tune_step > 1) p->tune_step /= 2;
+	} else {
+		if (latency > p->tune_latency * 1.25) p->tune_dir = -1;
+		p->tune_step = 1;
+	}
+
+	limit += p->tune_dir * p->tune_step;
+	if (limit < 1) { limit = 1; p->tune_dir = 1; }
+	if (limit > p->nthreads) { limit = p->nthreads; p->tune_dir = -1; }
+
+	if (limit > p->limit) pthread_cond_broadcast(&p->work);
+	p->limit = limit;
+	p->tune_score = score;
+	p->tune_latency = latency;
+	p->tune_size = size;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131252
+  Function Name	: stats_fill
+  Returns Type	: void
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  struct unback_stats *s , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void stats_fill( struct unback_ctx *x, struct unback_stats *s ) {
+	struct timespec now;
+	struct rusage ru;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	s->files = __atomic_load_n(&x->pool.files, __ATOMIC_RELAXED);
+	s->bytes = __atomic_load_n(&x->pool.bytes, __ATOMIC_RELAXED);
+	s->latency_ns = __atomic_load_n(&x->pool.latency_ns, __ATOMIC_RELAXED);
+	s->jobs = x->pool.limit;
+	s->prefetched = __atomic_load_n(&x->pf.hinted, __ATOMIC_RELAXED);
+	s->throttle_ns = __atomic_load_n(&x->th.wait_ns, __ATOMIC_RELAXED);
+	if (getrusage(RUSAGE_SELF, &ru) == 0) s->peak_rss = (uint64_t)ru.ru_maxrss * 1024;
+	s->secs = (now.tv_sec -x->start.tv_sec) + (now.tv_nsec -x->start.tv_nsec) / 1e9;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131253
+  Function Name	: pool_controller
+  Returns Type	: void *
+  ----Parameter List
+  1. void *arg , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Wakes every POOL_TICK_MS to measure the copy throughput and
+	latency over the last window (smoothed over about two
+	windows), retunes the worker limit for UNBACK_JOBS_AUTO and
+	calls the progress callback once a second.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void *pool_controller( void *arg ) {
+	struct unback_ctx *x = arg;
+	struct pool *p = &x->pool;
+	struct unback_stats s;
+	struct timespec wake, now, last;
+	uint64_t files = 0, bytes = 0, latency = 0, df, db, dl;
+	double secs, score = 0, lat = 0;
+	int ticks = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	pthread_mutex_lock(&p->lock);
+	while (!p->done) {
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_nsec += POOL_TICK_MS * 1000000L;
+		if (wake.tv_nsec >= 1000000000L) { wake.tv_sec++; wake.tv_nsec -= 1000000000L; }
+		pthread_cond_timedwait(&p->tick, &p->lock, &wake);
+		if (p->done) break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		secs = (now.tv_sec -last.tv_sec) + (now.tv_nsec -last.tv_nsec) / 1e9;
+		last = now;
+		df = __atomic_load_n(&p->files, __ATOMIC_RELAXED) -files;
+		db = __atomic_load_n(&p->bytes, __ATOMIC_RELAXED) -bytes;
+		dl = __atomic_load_n(&p->latency_ns, __ATOMIC_RELAXED) -latency;
+		files += df;
+		bytes += db;
+		latency += dl;
+
+		score = (score + (db + df * (double)POOL_AUTO_OP_BYTES) / secs) / 2;
+		if (df) lat = (lat + (double)dl / df) / 2;
+
+		/*
+		 * Only tune when there was work, and the queue wasn't
+		 * drained, otherwise the decoder is what limits us.
+		 */
+		if ((x->o.jobs == UNBACK_JOBS_AUTO)&&(df + db > 0)&&(p->queued > 0)) {
+			pool_tune( p, score, lat, df ? (double)db / df : p->tune_size );
+		}
+
+		if ((x->o.progress)&&(++ticks % (1000 / POOL_TICK_MS) == 0)) {
+			stats_fill( x, &s );
+			pthread_mutex_unlock(&p->lock);
+			x->o.progress( x->o.arg, &s );
+			pthread_mutex_lock(&p->lock);
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131254
+  Function Name	: pool_start
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x , 
+  ------------------
+  Exit Codes	: -1 if no worker could be started
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	UNBACK_JOBS_AUTO starts POOL_MAX_THREADS workers with
+	POOL_AUTO_START of them allowed to run, jobs N starts N.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int pool_start( struct unback_ctx *x ) {
+	struct pool *p = &x->pool;
+	int i, n;
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->work, NULL);
+	pthread_cond_init(&p->space, NULL);
+	pthread_cond_init(&p->tick, NULL);
+	pthread_cond_init(&p->idle, NULL);
+	p->head = p->tail = NULL;
+	p->queued = p->active = p->done = 0;
+	p->queued_bytes = 0;
+
+	if (x->o.jobs == UNBACK_JOBS_AUTO) {
+		n = POOL_MAX_THREADS;
+		p->limit = POOL_AUTO_START;
+	} else {
+		n = p->limit = x->o.jobs;
+	}
+	p->tune_dir = 1;
+	p->tune_step = 1;
+
+	for (p->nthreads = 0; p->nthreads < n; p->nthreads++) {
+		i = pthread_create(&p->threads[p->nthreads], NULL, pool_worker, x);
+		if (i != 0) {
+			fprintf(stderr,"Cannot start copy worker (%s)\n", strerror(i));
+			break;
+		}
+	}
+	if (p->nthreads == 0) return -1;
+	if (p->limit > p->nthreads) p->limit = p->nthreads;
+	i = pthread_create(&p->controller, NULL, pool_controller, x);
+	if (i != 0) {
+		fprintf(stderr,"Cannot start copy pool controller, concurrency stays at %d (%s)\n", p->limit, strerror(i));
+		p->controlled = 0;
+	} else p->controlled = 1;
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131255
+  Function Name	: pool_submit
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  struct recbuf *job , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: blocks while the queue is full
+  --------------------------------------------------------------------
+Comments:
+	Queues a copy for the workers, which free job once done.  With
+	o.memory_budget the queue is also held to a quarter of the
+	budget in bytes.
+
+--------------------------------------------------------------------
+Changes:
+	Takes a record already copied by the caller.
+
+	Bounded in bytes as well as in jobs.
+
+\------------------------------------------------------------------*/
+static int pool_submit( struct unback_ctx *x, struct recbuf *job ) {
+	struct pool *p = &x->pool;
+
+	job->next = NULL;
+	pthread_mutex_lock(&p->lock);
+	while ((p->queued >= p->limit * 4)
+			||((x->o.memory_budget)&&(p->queued > 0)&&(p->queued_bytes +job->alloc > x->o.memory_budget / 4))) {
+		pthread_cond_wait(&p->space, &p->lock);
+	}
+	if (p->tail) p->tail->next = job; else p->head = job;
+	p->tail = job;
+	p->queued++;
+	p->queued_bytes += job->alloc;
+	pthread_cond_signal(&p->work);
+	pthread_mutex_unlock(&p->lock);
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170111-192010
+  Function Name	: pool_drain
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Waits until every queued copy has completed, the workers are
+	left running.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int pool_drain( struct unback_ctx *x ) {
+	struct pool *p = &x->pool;
+
+	pthread_mutex_lock(&p->lock);
+	while ((p->head)||(p->active)) pthread_cond_wait(&p->idle, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170104-210410
+  Function Name	: prefetch_worker
+  Returns Type	: void *
+  ----Parameter List
+  1. void *arg , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Takes fileIDs off the ring and hints their blobs with
+	POSIX_FADV_WILLNEED, which starts asynchronous reads of the
+	first PREFETCH_BYTES in to the page cache.  The open also warms
+	the directory entry and attribute caches, which is most of the
+	per file latency on NFS.  Several of these run so that one slow
+	open doesn't hold up the rest of the window.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void *prefetch_worker( void *arg ) {
+	struct unback_ctx *x = arg;
+	struct prefetch *pf = &x->pf;
+	char fileID[SHA1_BLOCK_SIZE * 2 +1];
+	int sdir, fd;
+
+	pthread_mutex_lock(&pf->lock);
+	for (;;) {
+		while ((pf->get == pf->put)&&(!pf->done)) pthread_cond_wait(&pf->cond, &pf->lock);
+		if (pf->get == pf->put) break;
+
+		memcpy(fileID, pf->ids[pf->get % x->o.prefetch], sizeof(fileID));
+		pf->get++;
+		pthread_mutex_unlock(&pf->lock);
+
+		sdir = input_dirfd( x->u, fileID );
+		if (sdir != -1) {
+			fd = openat( sdir, fileID, O_RDONLY|O_NOATIME );
+			if (fd == -1) fd = openat( sdir, fileID, O_RDONLY ); // O_NOATIME needs ownership
+			if (fd != -1) {
+				posix_fadvise( fd, 0, PREFETCH_BYTES, POSIX_FADV_WILLNEED );
+				close(fd);
+				__atomic_add_fetch(&pf->hinted, 1, __ATOMIC_RELAXED);
+			}
+		}
+
+		pthread_mutex_lock(&pf->lock);
+	}
+	pthread_mutex_unlock(&pf->lock);
+
+	return NULL;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170104-210420
+  Function Name	: prefetch_start
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x , 
+  ------------------
+  Exit Codes	: -1 if no prefetch thread could be started
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int prefetch_start( struct unback_ctx *x ) {
+	struct prefetch *pf = &x->pf;
+
+	pf->ids = calloc(x->o.prefetch, sizeof(*pf->ids));
+	if (pf->ids == NULL) return -1;
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->cond, NULL);
+
+	for (pf->nthreads = 0; pf->nthreads < PREFETCH_THREADS; pf->nthreads++) {
+		if (pthread_create(&pf->threads[pf->nthreads], NULL, prefetch_worker, x) != 0) break;
+	}
+	if (pf->nthreads == 0) {
+		pthread_mutex_destroy(&pf->lock);
+		pthread_cond_destroy(&pf->cond);
+		free(pf->ids);
+		pf->ids = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170104-210430
+  Function Name	: copy_record
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  struct recbuf *rb , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: frees rb, or passes it on to the copy workers
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int copy_record( struct unback_ctx *x, struct recbuf *rb ) {
+	int result;
+
+	if (x->pool.nthreads) return pool_submit( x, rb );
+
+	result = unback_blob( x, &rb->r );
+	free(rb);
+
+	return result;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170104-210440
+  Function Name	: prefetch_push
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  struct recbuf *rb , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Puts rb at the back of the read-ahead window, hinting its blob,
+	and copies the record falling out of the front of the window.
+	Should the prefetch threads fall a whole window behind, the
+	oldest hints are skipped as their records are about to be
+	copied anyway.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int prefetch_push( struct unback_ctx *x, struct recbuf *rb ) {
+	struct prefetch *pf = &x->pf;
+	struct recbuf *out = NULL;
+
+	rb->next = NULL;
+	pthread_mutex_lock(&pf->lock);
+	if (pf->tail) pf->tail->next = rb; else pf->head = rb;
+	pf->tail = rb;
+	pf->queued++;
+	if (pf->queued > x->o.prefetch) {
+		out = pf->head;
+		pf->head = out->next;
+		pf->queued--;
+	}
+
+	if (pf->put -pf->get >= (unsigned long)x->o.prefetch) pf->get++;
+	snprintf(pf->ids[pf->put % x->o.prefetch], sizeof(*pf->ids), "%s", rb->r.fileID.s);
+	pf->put++;
+	pthread_cond_signal(&pf->cond);
+	pthread_mutex_unlock(&pf->lock);
+
+	if (out) return copy_record( x, out );
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170104-210450
+  Function Name	: prefetch_flush
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Copies what is left in the read-ahead window.  Nothing else may
+	be pushing at the same time.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int prefetch_flush( struct unback_ctx *x ) {
+	struct prefetch *pf = &x->pf;
+	struct recbuf *rb, *next;
+
+	pthread_mutex_lock(&pf->lock);
+	rb = pf->head;
+	pf->head = pf->tail = NULL;
+	pf->queued = 0;
+	pthread_mutex_unlock(&pf->lock);
+
+	for (; rb; rb = next) {
+		next = rb->next;
+		copy_record( x, rb );
+	}
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170104-210451
+  Function Name	: prefetch_finish
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Copies what is left in the window and stops the prefetch
+	threads, the decoders must have finished.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int prefetch_finish( struct unback_ctx *x ) {
+	struct prefetch *pf = &x->pf;
+	int i;
+
+	prefetch_flush( x );
+
+	pthread_mutex_lock(&pf->lock);
+	pf->done = 1;
+	pf->get = pf->put; // nothing left to copy, drop the outstanding hints
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->lock);
+
+	for (i = 0; i < pf->nthreads; i++) pthread_join(pf->threads[i], NULL);
+	pthread_mutex_destroy(&pf->lock);
+	pthread_cond_destroy(&pf->cond);
+	free(pf->ids);
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170308-201010
+  Function Name	: spill_open
+  Returns Type	: FILE *
+  ----Parameter List
+  1. const char *dir , 
+  ------------------
+  Exit Codes	: NULL if the file couldn't be made
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	An anonymous temporary file for a sort run, in dir, or TMPDIR,
+	or /tmp.  Unlinked straight away so nothing is left behind
+	however we exit.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static FILE *spill_open( const char *dir ) {
+	char path[PATH_MAX];
+	FILE *f;
+	int fd;
+
+	if (dir == NULL) dir = getenv("TMPDIR");
+	if ((dir == NULL)||(*dir == '\0')) dir = "/tmp";
+	snprintf(path, sizeof(path), "%s/unback-run-XXXXXX", dir);
+	fd = mkstemp(path);
+	if (fd == -1) {
+		fprintf(stderr,"Cannot make a sort run in '%s' (%s), carrying on in memory\n", dir, strerror(errno));
+		return NULL;
+	}
+	unlink(path);
+	f = fdopen(fd, "w+");
+	if (f == NULL) close(fd);
+
+	return f;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170308-201020
+  Function Name	: spill_read
+  Returns Type	: int
+  ----Parameter List
+  1. FILE *f, 
+  2.  struct sched_entry *e , 
+  ------------------
+  Exit Codes	: 1 for an entry, 0 at the end of the run, -1 on error
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Reads the next entry of a run back in to memory.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int spill_read( FILE *f, struct sched_entry *e ) {
+	struct spill_head h;
+	struct recbuf *rb;
+
+	if (fread(&h, sizeof(h), 1, f) != 1) return 0;
+	rb = malloc(h.alloc);
+	if ((rb == NULL)||(fread(rb, h.alloc, 1, f) != 1)) {
+		fprintf(stderr,"ERROR: Cannot read back a sort run (%s), the rest of it is lost\n", rb ? "short read" : "out of memory");
+		free(rb);
+		return -1;
+	}
+	rb->next = NULL;
+	rb->chunk = NULL;
+	recbuf_relink( rb );
+	e->rb = rb;
+	e->tier = h.tier;
+	e->size = h.size;
+	e->seq = h.seq;
+
+	return 1;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170308-201030
+  Function Name	: sched_spill
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x , 
+  ------------------
+  Exit Codes	: -1 if the run couldn't be written
+  Side Effects	: empties sched.entries
+  --------------------------------------------------------------------
+Comments:
+	Sorts the records held in memory and writes them out as a new
+	run, called with the sched lock held so the decoders wait for
+	it.  If the run can't be written the records stay where they
+	are and no more runs are tried; going over the budget beats
+	losing the plan.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int sched_spill( struct unback_ctx *x ) {
+	struct sched *sc = x->sched;
+	struct sched_entry *e;
+	struct spill_head h;
+	FILE *f, **runs;
+	size_t i;
+
+	qsort(sc->entries, sc->count, sizeof(struct sched_entry), sc->cmp);
+
+	f = spill_open( x->o.spill_dir );
+	runs = f ? realloc(sc->runs, (sc->nruns +1) * sizeof(FILE *)) : NULL;
+	if (runs == NULL) {
+		if (f) fclose(f);
+		sc->nospill = 1;
+		return -1;
+	}
+	sc->runs = runs;
+
+	for (i = 0; i < sc->count; i++) {
+		e = &sc->entries[i];
+		memset(&h, 0, sizeof(h));
+		h.alloc = e->rb->alloc;
+		h.size = e->size;
+		h.seq = e->seq;
+		h.tier = e->tier;
+		if ((fwrite(&h, sizeof(h), 1, f) != 1)||(fwrite(e->rb, e->rb->alloc, 1, f) != 1)) break;
+	}
+	if ((i < sc->count)||(fflush(f) != 0)) {
+		fprintf(stderr,"Cannot write a sort run (%s), carrying on in memory\n", strerror(errno));
+		fclose(f);
+		sc->nospill = 1;
+		return -1;
+	}
+
+	for (i = 0; i < sc->count; i++) free(sc->entries[i].rb);
+	sc->runs[sc->nruns++] = f;
+	sc->count = 0;
+	sc->held = 0;
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170111-192020
+  Function Name	: sched_add
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  const struct unback_record *r , 
+  ------------------
+  Exit Codes	: -1 when out of memory
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Copies a file record in to the extraction plan, tagged with the
+	tier of the first rule matching it.  With o.smallest_first the
+	blob is stat()'d when the manifest doesn't give the size, which
+	is always the case for Manifest.db.
+
+	With o.memory_budget the held records are spilled to a run once
+	they pass three quarters of it, the copy queue has the rest.
+
+--------------------------------------------------------------------
+Changes:
+	Spills to disk over the memory budget.
+
+\------------------------------------------------------------------*/
+static int sched_add( struct unback_ctx *x, const struct unback_record *r ) {
+	struct sched *sc = x->sched;
+	struct sched_entry *e;
+	const struct unback_rule *rule;
+	struct recbuf *rb;
+	struct stat st;
+	int i, tier = sc->fallback_tier;
+	uint64_t size;
+
+	rb = recbuf_dup( r );
+	if (rb == NULL) {
+		fprintf(stderr,"Out of memory planning '%.*s'\n", (int)r->path.len, r->path.s);
+		__atomic_add_fetch(&x->failed, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	for (i = 0; i < x->o.nrules; i++) {
+		rule = &x->o.rules[i];
+		if ((rule->domain)&&(fnmatch(rule->domain, rb->r.domain.s, 0) != 0)) continue;
+		if ((rule->path)&&(fnmatch(rule->path, rb->r.path.s, 0) != 0)) continue;
+		tier = rule->tier;
+		break;
+	}
+
+	size = r->size;
+	if ((x->o.smallest_first)&&(size == 0)&&(unback_blob_stat( x->u, r, &st ) == 0)) size = st.st_size;
+
+	pthread_mutex_lock(&sc->lock);
+	if (sc->count == sc->size) {
+		e = realloc(sc->entries, (sc->size ? sc->size * 2 : 1024) * sizeof(struct sched_entry));
+		if (e == NULL) {
+			pthread_mutex_unlock(&sc->lock);
+			fprintf(stderr,"Out of memory planning '%.*s'\n", (int)r->path.len, r->path.s);
+			__atomic_add_fetch(&x->failed, 1, __ATOMIC_RELAXED);
+			free(rb);
+			return -1;
+		}
+		sc->entries = e;
+		sc->size = sc->size ? sc->size * 2 : 1024;
+	}
+	e = &sc->entries[sc->count++];
+	e->rb = rb;
+	e->tier = tier;
+	e->size = size;
+	e->seq = sc->seq++;
+	sc->held += rb->alloc +sizeof(struct sched_entry);
+	if ((x->o.memory_budget)&&(sc->held > x->o.memory_budget -x->o.memory_budget / 4)&&(!sc->nospill)) sched_spill( x );
+	pthread_mutex_unlock(&sc->lock);
+
+	return 0;
+}
+
+
+
+static int sched_cmp( const void *a, const void *b ) {
+	const struct sched_entry *ea = a, *eb = b;
+
+	if (ea->tier != eb->tier) return ea->tier < eb->tier ? -1 : 1;
+	return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+static int sched_cmp_size( const void *a, const void *b ) {
+	const struct sched_entry *ea = a, *eb = b;
+
+	if (ea->tier != eb->tier) return ea->tier < eb->tier ? -1 : 1;
+	if (ea->size != eb->size) return ea->size < eb->size ? -1 : 1;
+	return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170308-201040
+  Function Name	: sched_next
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  struct sched_entry *e , 
+  ------------------
+  Exit Codes	: 0 once the plan is exhausted
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Next entry of the plan in order, the smallest of the sorted
+	entries still in memory and the head of each run.  Runs are few
+	(the plan size over the budget) so a linear scan of the heads
+	does.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int sched_next( struct unback_ctx *x, struct sched_entry *e ) {
+	struct sched *sc = x->sched;
+	struct sched_entry *best = NULL;
+	int i, from = -1;
+
+	if (sc->next < sc->count) best = &sc->entries[sc->next];
+	for (i = 0; i < sc->nruns; i++) {
+		if (sc->heads[i].rb == NULL) continue;
+		if ((best == NULL)||(sc->cmp( &sc->heads[i], best ) < 0)) {
+			best = &sc->heads[i];
+			from = i;
+		}
+	}
+	if (best == NULL) return 0;
+
+	*e = *best;
+	if (from == -1) sc->next++;
+	else if (spill_read( sc->runs[from], &sc->heads[from] ) != 1) sc->heads[from].rb = NULL;
+
+	return 1;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170111-192030
+  Function Name	: sched_run
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: empties the plan
+  --------------------------------------------------------------------
+Comments:
+	Copies the planned files tier by tier, lowest first, and within
+	a tier smallest first or in manifest order.  Each tier is fully
+	on disk before o.tier_done is called for it and the next tier
+	is started, so the caller can hand early tiers on whilst the
+	rest are still copying.
+
+--------------------------------------------------------------------
+Changes:
+	Merges the spilled runs.
+
+\------------------------------------------------------------------*/
+static int sched_run( struct unback_ctx *x ) {
+	struct sched *sc = x->sched;
+	struct sched_entry cur, next;
+	uint64_t n = 0;
+	int i, have;
+
+	qsort(sc->entries, sc->count, sizeof(struct sched_entry), sc->cmp);
+	sc->next = 0;
+	if (sc->nruns) {
+		sc->heads = calloc(sc->nruns, sizeof(struct sched_entry));
+		if (sc->heads == NULL) {
+			fprintf(stderr,"ERROR: Out of memory merging %d sort runs, they are lost\n", sc->nruns);
+			__atomic_add_fetch(&x->failed, 1, __ATOMIC_RELAXED);
+			for (i = 0; i < sc->nruns; i++) fclose(sc->runs[i]);
+			sc->nruns = 0;
+		}
+		for (i = 0; i < sc->nruns; i++) {
+			rewind(sc->runs[i]);
+			if (spill_read( sc->runs[i], &sc->heads[i] ) != 1) sc->heads[i].rb = NULL;
+		}
+	}
+
+	have = sched_next( x, &cur );
+	while (have) {
+		have = sched_next( x, &next );
+		if (x->pf.nthreads) prefetch_push( x, cur.rb );
+		else copy_record( x, cur.rb );
+		n++;
+
+		if ((have)&&(next.tier == cur.tier)) {
+			cur = next;
+			continue;
+		}
+
+		if (x->pf.nthreads) prefetch_flush( x );
+		if (x->pool.nthreads) pool_drain( x );
+		if (x->o.tier_done) x->o.tier_done( x->o.arg, cur.tier, n );
+		n = 0;
+		cur = next;
+	}
+	sc->count = 0;
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170111-192040
+  Function Name	: sched_start
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x , 
+  ------------------
+  Exit Codes	: -1 when out of memory
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Records no rule matches go in to the tier after the highest
+	rule tier.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int sched_start( struct unback_ctx *x ) {
+	struct sched *sc;
+	int i;
+
+	sc = calloc(1, sizeof(struct sched));
+	if (sc == NULL) return -1;
+	pthread_mutex_init(&sc->lock, NULL);
+	for (i = 0; i < x->o.nrules; i++) {
+		if (x->o.rules[i].tier >= sc->fallback_tier) sc->fallback_tier = x->o.rules[i].tier +1;
+	}
+	sc->cmp = x->o.smallest_first ? sched_cmp_size : sched_cmp;
+	x->sched = sc;
+
+	return 0;
+}
+
+static int sched_finish( struct unback_ctx *x ) {
+	struct sched *sc = x->sched;
+	int i;
+
+	sched_run( x );
+	for (i = 0; i < sc->nruns; i++) fclose(sc->runs[i]);
+	pthread_mutex_destroy(&sc->lock);
+	free(sc->runs);
+	free(sc->heads);
+	free(sc->entries);
+	free(sc);
+	x->sched = NULL;
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131256
+  Function Name	: pool_finish
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Lets the workers drain the queue, then joins them.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int pool_finish( struct unback_ctx *x ) {
+	struct pool *p = &x->pool;
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	p->done = 1;
+	pthread_cond_broadcast(&p->work);
+	pthread_cond_signal(&p->tick);
+	pthread_mutex_unlock(&p->lock);
+
+	for (i = 0; i < p->nthreads; i++) pthread_join(p->threads[i], NULL);
+	if (p->controlled) pthread_join(p->controller, NULL);
+
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->work);
+	pthread_cond_destroy(&p->space);
+	pthread_cond_destroy(&p->tick);
+	pthread_cond_destroy(&p->idle);
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170201-212020
+  Function Name	: tail_copy
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  struct tail_entry *e , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Extracts a blob which has just been finalised, noting what it
+	looked like so the final pass can tell whether it has been
+	written again since.  tail_done() marks it TAIL_DONE once the
+	copy has succeeded.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int tail_copy( struct unback_ctx *x, struct tail_entry *e ) {
+	struct recbuf *rb;
+	struct stat st;
+	int sdir;
+
+	sdir = input_dirfd( x->u, e->fileID );
+	if ((sdir == -1)||(fstatat( sdir, e->fileID, &st, 0 ) == -1)) return 0;
+
+	rb = recbuf_dup( &e->rb->r );
+	if (rb == NULL) return -1;
+	pthread_mutex_lock(&x->tail->lock);
+	e->flags = TAIL_COPYING;
+	e->ino = st.st_ino;
+	e->size = st.st_size;
+	e->mtime = st.st_mtim;
+	pthread_mutex_unlock(&x->tail->lock);
+
+	return copy_record( x, rb );
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170201-212030
+  Function Name	: tail_unchanged
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  const struct unback_record *r , 
+  ------------------
+  Exit Codes	: 1 if r's blob was extracted whilst tailing and hasn't changed
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Used by the final reconciliation pass, only reads the table so
+	is safe from the parallel decoders.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int tail_unchanged( struct unback_ctx *x, const struct unback_record *r ) {
+	struct tail_entry *e;
+	struct stat st;
+
+	e = tail_find( x->tail, r->fileID.s, 0 );
+	if ((e == NULL)||(!(e->flags & TAIL_DONE))) return 0;
+	if (unback_blob_stat( x->u, r, &st ) == -1) return 0;
+
+	return ((st.st_ino == e->ino)&&(st.st_size == e->size)
+			&&(st.st_mtim.tv_sec == e->mtime.tv_sec)&&(st.st_mtim.tv_nsec == e->mtime.tv_nsec));
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170201-212040
+  Function Name	: tail_load
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x , 
+  ------------------
+  Exit Codes	: -1 if the manifest couldn't be read
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	(Re)reads the manifest in to the table, the file records we
+	are to extract at least, then extracts any blob which was
+	finalised before the manifest listed it.  For mbdb backups this
+	is the previous backup's manifest until the new one is written.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int tail_load( struct unback_ctx *x ) {
+	struct tail *t = x->tail;
+	struct unback_cursor *c;
+	struct unback_record r;
+	struct tail_entry *e;
+	size_t i;
+	int rc;
+
+	for (i = 0; i < t->size; i++) {
+		free(t->tab[i].rb);
+		t->tab[i].rb = NULL;
+	}
+
+	c = unback_cursor_open( x->u, 0 );
+	if (c == NULL) return -1;
+	while ((rc = unback_cursor_next( c, &r )) == 1) {
+		if (r.type != UNBACK_TYPE_FILE) continue;
+		if ((x->o.filter)&&(x->o.filter( x->o.arg, &r ) == 0)) continue;
+		if (unback_shard_of( r.fileID.s, x->o.shard_count ) != x->o.shard_index) continue;
+		pthread_mutex_lock(&t->lock);
+		e = tail_find( t, r.fileID.s, 1 );
+		pthread_mutex_unlock(&t->lock);
+		if (e == NULL) break;
+		free(e->rb);
+		e->rb = recbuf_dup( &r );
+	}
+	unback_cursor_close( c );
+
+	for (i = 0; i < t->size; i++) {
+		if ((t->tab[i].flags & TAIL_PENDING)&&(t->tab[i].rb)) tail_copy( x, &t->tab[i] );
+	}
+
+	return rc;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170201-212050
+  Function Name	: tail_watch_shard
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  const char *name , 
+  ------------------
+  Exit Codes	: -1 if name isn't a shard folder
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	A shard folder which has only just been created may have been
+	looked up, and found missing, already.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int tail_watch_shard( struct unback_ctx *x, const char *name ) {
+	struct unback *u = x->u;
+	char path[PATH_MAX];
+	int shard;
+
+	shard = shard_index( name );
+	if ((shard == -1)||(name[2] != '\0')) return -1;
+
+	snprintf(path, sizeof(path), "%s/%s", u->inputpath, name);
+	x->tail->shard_wd[shard] = inotify_add_watch( x->tail->ifd, path, IN_CLOSE_WRITE|IN_MOVED_TO|IN_ONLYDIR );
+
+	pthread_mutex_lock(&u->shard_lock);
+	if (u->shard_fd[shard] == -2) u->shard_fd[shard] = -1;
+	pthread_mutex_unlock(&u->shard_lock);
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170201-212060
+  Function Name	: tail_event
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  const struct inotify_event *ev , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	A new shard folder gets watched, a rewritten manifest reloaded,
+	and a finalised blob extracted if the manifest knows where it
+	goes, otherwise it waits for the next manifest.  The backup is
+	done once idevicebackup2 writes a Status.plist saying so.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int tail_event( struct unback_ctx *x, const struct inotify_event *ev ) {
+	struct tail *t = x->tail;
+	struct tail_entry *e;
+	char buf[4096];
+	int fd, i;
+	ssize_t n;
+
+	if ((ev->len == 0)||(ev->mask & IN_Q_OVERFLOW)) return 0; // the final pass catches up
+
+	if (ev->wd == t->root_wd) {
+		if (ev->mask & IN_ISDIR) return tail_watch_shard( x, ev->name );
+
+		if ((strcmp(ev->name, "Manifest.db") == 0)||(strcmp(ev->name, "Manifest.mbdb") == 0)) {
+			// IN_CREATE is only wanted for the shard folders, the manifest is empty until it's closed
+			if ((ev->mask & (IN_CLOSE_WRITE|IN_MOVED_TO))&&(manifest_detect( x->u ) == 0)) tail_load( x );
+			return 0;
+		}
+
+		if (strcmp(ev->name, "Status.plist") == 0) {
+			fd = openat( x->u->input_fd, "Status.plist", O_RDONLY );
+			if (fd == -1) return 0;
+			n = read( fd, buf, sizeof(buf) );
+			close(fd);
+			if ((n > 0)&&(memmem(buf, n, "finished", 8))) t->finished = 1;
+			return 0;
+		}
+	}
+
+	if (ev->mask & IN_ISDIR) return 0;
+	if (strlen(ev->name) != SHA1_BLOCK_SIZE * 2) return 0;
+	for (i = 0; i < SHA1_BLOCK_SIZE * 2; i++) if (!strchr("0123456789abcdef", ev->name[i])) return 0;
+
+	pthread_mutex_lock(&t->lock);
+	e = tail_find( t, ev->name, 1 );
+	if ((e)&&(e->rb == NULL)) e->flags |= TAIL_PENDING;
+	pthread_mutex_unlock(&t->lock);
+	if (e == NULL) return -1;
+	if (e->rb) return tail_copy( x, e );
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131257
+  Function Name	: extract_record
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  const struct unback_record *r , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Decoder side of a record.  Every record is reported with an
+	ENTRY event, file records which pass the filter and belong to
+	our shard are then handed to the copy workers, or copied
+	straight away.
+
+--------------------------------------------------------------------
+Changes:
+	Was unback_file().
+
+	Goes through the read-ahead window with o.prefetch.
+
+	Held back for the priority scheduler with o.rules or
+	o.smallest_first.
+
+	Skips blobs unback_tail() has already extracted.
+
+\------------------------------------------------------------------*/
+static int extract_record( struct unback_ctx *x, const struct unback_record *r ) {
+	struct recbuf *rb;
+
+	if (x->o.event) x->o.event( x->o.arg, UNBACK_EVENT_ENTRY, r );
+
+	if (r->type != UNBACK_TYPE_FILE) return 0;
+	if ((x->o.filter)&&(x->o.filter( x->o.arg, r ) == 0)) return 0;
+	if (unback_shard_of( r->fileID.s, x->o.shard_count ) != x->o.shard_index) return 0;
+
+	if ((x->tail)&&(tail_unchanged( x, r ))) return 0;
+
+	if (x->sched) return sched_add( x, r );
+	if ((x->pool.nthreads == 0)&&(x->pf.nthreads == 0)) return unback_blob( x, r );
+
+	rb = recbuf_dup( r );
+	if (rb == NULL) {
+		fprintf(stderr,"Out of memory queueing '%.*s'\n", (int)r->path.len, r->path.s);
+		__atomic_add_fetch(&x->failed, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	if (x->pf.nthreads) return prefetch_push( x, rb );
+
+	return copy_record( x, rb );
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-132210
+  Function Name	: sq3_part_push
+  Returns Type	: int
+  ----Parameter List
+  1. struct sq3_part *part, 
+  2.  const struct unback_record *r , 
+  ------------------
+  Exit Codes	: -1 when out of memory
+  Side Effects	: blocks while the partition's queue is full
+  --------------------------------------------------------------------
+Comments:
+	ordered: keeps a decoded row until the rows of the earlier
+	partitions have all been handled.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int sq3_part_push( struct sq3_part *part, const struct unback_record *r ) {
+	struct recbuf *rb;
+
+	rb = recbuf_dup( r );
+	if (rb == NULL) {
+		fprintf(stderr,"Out of memory decoding '%.*s'\n", (int)r->path.len, r->path.s);
+		__atomic_add_fetch(&part->x->failed, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	pthread_mutex_lock(&part->lock);
+	while (part->queued >= SQ3_PART_QUEUE) pthread_cond_wait(&part->cond, &part->lock);
+	if (part->tail) part->tail->next = rb; else part->head = rb;
+	part->tail = rb;
+	part->queued++;
+	pthread_cond_broadcast(&part->cond);
+	pthread_mutex_unlock(&part->lock);
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-132220
+  Function Name	: sq3_part_decode
+  Returns Type	: void *
+  ----Parameter List
+  1. void *arg , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Partition decoder thread.  Reads the rows with rowid between
+	part->lo and part->hi through its own cursor, handling each
+	straight away, or queueing them for the calling thread when
+	ordered.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void *sq3_part_decode( void *arg ) {
+	struct sq3_part *part = arg;
+	struct unback_ctx *x = part->x;
+	struct unback_cursor *c;
+	struct unback_record r;
+
+	c = cursor_open_range( x->u, x->o.cursor_flags, 1, part->lo, part->hi );
+	if (c) {
+		while (unback_cursor_next( c, &r ) == 1) {
+			if ((x->o.ordered)&&(!part->local)) sq3_part_push( part, &r );
+			else extract_record( x, &r );
+		}
+		unback_cursor_close( c );
+	}
+
+	pthread_mutex_lock(&part->lock);
+	part->done = 1;
+	pthread_cond_broadcast(&part->cond);
+	pthread_mutex_unlock(&part->lock);
+
+	return NULL;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-132230
+  Function Name	: extract_partitions
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  sqlite3_int64 lo, 
+  3.  sqlite3_int64 hi , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Splits rowids lo..hi in to o.decoders ranges, each decoded by
+	its own thread.  When ordered the rows are handled here in
+	partition order, which is the same order a single cursor
+	produces.  A partition whose thread couldn't be started is
+	decoded here, after the earlier ones when ordered.
+
+--------------------------------------------------------------------
+Changes:
+	Was manifest_sqlite3_partitions().
+
+\------------------------------------------------------------------*/
+static int extract_partitions( struct unback_ctx *x, sqlite3_int64 lo, sqlite3_int64 hi ) {
+	struct sq3_part *parts, *part;
+	struct recbuf *rb, *next;
+	sqlite3_int64 span = hi -lo +1;
+	int i, n = x->o.decoders;
+
+	if (span < 1) return 0;
+	if (span < n) n = span;
+	parts = calloc(n, sizeof(struct sq3_part));
+	if (parts == NULL) {
+		fprintf(stderr,"Out of memory starting decoders\n");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		part = &parts[i];
+		part->x = x;
+		part->lo = lo + (span * i) / n;
+		part->hi = lo + (span * (i +1)) / n -1;
+		pthread_mutex_init(&part->lock, NULL);
+		pthread_cond_init(&part->cond, NULL);
+		if (pthread_create(&part->thread, NULL, sq3_part_decode, part) != 0) part->local = 1;
+	}
+
+	if (x->o.ordered) {
+		for (i = 0; i < n; i++) {
+			part = &parts[i];
+			if (part->local) sq3_part_decode( part ); // the earlier partitions are done
+			pthread_mutex_lock(&part->lock);
+			for (;;) {
+				while ((part->head == NULL)&&(!part->done)) pthread_cond_wait(&part->cond, &part->lock);
+				if (part->head == NULL) break;
+
+				rb = part->head;
+				part->head = part->tail = NULL;
+				part->queued = 0;
+				pthread_cond_broadcast(&part->cond);
+				pthread_mutex_unlock(&part->lock);
+
+				for (; rb; rb = next) {
+					next = rb->next;
+					extract_record( x, &rb->r );
+					free(rb);
+				}
+
+				pthread_mutex_lock(&part->lock);
+			}
+			pthread_mutex_unlock(&part->lock);
+		}
+	} else {
+		for (i = 0; i < n; i++) if (parts[i].local) sq3_part_decode( &parts[i] );
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!parts[i].local) pthread_join(parts[i].thread, NULL);
+		pthread_mutex_destroy(&parts[i].lock);
+		pthread_cond_destroy(&parts[i].cond);
+	}
+	free(parts);
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131836
+  Function Name	: sq3_rowid_range
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback *u, 
+  2.  sqlite3_int64 *lo, 
+  3.  sqlite3_int64 *hi , 
+  ------------------
+  Exit Codes	: -1 if Files has no usable rowid
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	An empty Files table gives lo > hi.
+
+--------------------------------------------------------------------
+Changes:
+	Split out of manifest_sqlite3_decode().
+
+\------------------------------------------------------------------*/
+static int sq3_rowid_range( struct unback *u, sqlite3_int64 *lo, sqlite3_int64 *hi ) {
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	int rc, result = -1;
+
+	rc = sqlite3_open_v2( u->manifest_filename, &db, SQLITE_OPEN_READONLY|SQLITE_OPEN_NOMUTEX, NULL );
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_prepare_v2( db, "SELECT min(rowid), max(rowid) from Files;", -1, &stmt, NULL );
+		if (rc == SQLITE_OK) {
+			if (sqlite3_step(stmt) == SQLITE_ROW) {
+				*lo = 1;
+				*hi = 0;
+				if (sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+					*lo = sqlite3_column_int64(stmt, 0);
+					*hi = sqlite3_column_int64(stmt, 1);
+				}
+				result = 0;
+			}
+			sqlite3_finalize(stmt);
+		}
+	}
+	sqlite3_close(db);
+
+	return result;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131837
+  Function Name	: unback_options_init
+  Returns Type	: void
+  ----Parameter List
+  1. struct unback_options *o , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Defaults; copy inline, one decoder, no sharding or callbacks.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+void unback_options_init( struct unback_options *o ) {
+	memset(o, 0, sizeof(struct unback_options));
+	o->decoders = 1;
+	o->shard_count = 1;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170201-211030
+  Function Name	: ctx_start
+  Returns Type	: struct unback_ctx *
+  ----Parameter List
+  1. struct unback *u, 
+  2.  const struct unback_options *o, 
+  3.  int *rc , 
+  ------------------
+  Exit Codes	: NULL when out of memory
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Sets up an extraction; the output sink, copy workers and the
+	rest.  *rc is -1 if the output couldn't be opened, the context
+	still has to go to ctx_finish().
+
+--------------------------------------------------------------------
+Changes:
+	Split out of unback_extract().
+
+\------------------------------------------------------------------*/
+static struct unback_ctx *ctx_start( struct unback *u, const struct unback_options *o, int *rc ) {
+	struct unback_ctx *x;
+	char *outputpath;
+
+	*rc = 0;
+	x = calloc(1, sizeof(struct unback_ctx));
+	if (x == NULL) return NULL;
+	x->u = u;
+	x->o = *o;
+	x->output_fd = -1;
+	if ((x->o.shard_count < 1)||(x->o.shard_index < 0)||(x->o.shard_index >= x->o.shard_count)) {
+		x->o.shard_count = 1;
+		x->o.shard_index = 0;
+	}
+	if (x->o.jobs > POOL_MAX_THREADS) x->o.jobs = POOL_MAX_THREADS;
+	if (x->o.decoders > DECODERS_MAX) x->o.decoders = DECODERS_MAX;
+	if (x->o.prefetch > PREFETCH_MAX) x->o.prefetch = PREFETCH_MAX;
+	if (x->o.chunk_size == 0) x->o.chunk_size = CHUNK_SIZE;
+	x->o.chunk_size = (x->o.chunk_size +DIRECT_ALIGN -1) & ~(uint64_t)(DIRECT_ALIGN -1);
+	pthread_mutex_init(&x->dircache_lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &x->start);
+
+	pthread_mutex_init(&x->th.lock, NULL);
+	x->th.rate[THROTTLE_BYTES] = x->o.max_bandwidth;
+	x->th.rate[THROTTLE_OPS] = x->o.max_iops;
+	x->th.path = x->o.throttle_file;
+	x->th.last = x->start;
+	x->th.on = ((x->th.path)||(x->o.max_bandwidth)||(x->o.max_iops));
+	if ((x->th.path)&&(throttle_load( &x->th ) == -1)) {
+		fprintf(stderr,"Cannot read throttle file '%s' (%s), will keep trying\n", x->th.path, strerror(errno));
+	}
+
+	x->fs.begin_dir = fs_begin_dir;
+	x->fs.open_file = fs_open_file;
+	x->fs.write = fs_write;
+	x->fs.close = fs_close;
+	x->fs.link = fs_link;
+	x->fs.arg = x;
+	x->sink = x->o.sink ? x->o.sink : &x->fs;
+
+	if ((x->o.decode_only == 0)&&(x->o.sink == NULL)) {
+		outputpath = strdup(o->outputpath ? o->outputpath : "");
+		if ((outputpath)&&(*outputpath)&&(mkdirp( outputpath, S_IRWXU ) == 0)) {
+			x->output_fd = open(outputpath, O_RDONLY|O_DIRECTORY);
+		}
+		if (x->output_fd == -1) {
+			fprintf(stderr,"Cannot open output path '%s' (%s)\n", o->outputpath ? o->outputpath : "", strerror(errno));
+			*rc = -1;
+		}
+		free(outputpath);
+	}
+
+	x->pool.limit = 1;
+	if (*rc == 0) {
+		if ((x->o.jobs)&&(x->o.decode_only == 0)) pool_start( x );
+		if ((x->o.durability == UNBACK_DURABILITY_BATCH)&&(x->output_fd != -1)) syncer_start( x );
+		if ((x->o.prefetch > 0)&&(x->o.decode_only == 0)) prefetch_start( x );
+		if ((x->o.nrules > 0)||(x->o.smallest_first)) sched_start( x );
+	}
+
+	return x;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170201-211040
+  Function Name	: ctx_decode
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x , 
+  ------------------
+  Exit Codes	: -1 if the manifest couldn't be read
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Runs every manifest record through extract_record().
+
+--------------------------------------------------------------------
+Changes:
+	Split out of unback_extract().
+
+\------------------------------------------------------------------*/
+static int ctx_decode( struct unback_ctx *x ) {
+	struct unback_cursor *c;
+	struct unback_record r;
+	sqlite3_int64 lo, hi;
+	int rc;
+
+	if ((x->u->manifest_type == UNBACK_MANIFEST_SQL)&&(x->o.decoders > 1)&&(sq3_rowid_range( x->u, &lo, &hi ) == 0)) {
+		return extract_partitions( x, lo, hi );
+	}
+
+	c = unback_cursor_open( x->u, x->o.cursor_flags );
+	if (c == NULL) return -1;
+	while ((rc = unback_cursor_next( c, &r )) == 1) extract_record( x, &r );
+	unback_cursor_close( c );
+
+	return rc;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170201-211050
+  Function Name	: ctx_finish
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback_ctx *x, 
+  2.  struct unback_stats *stats , 
+  ------------------
+  Exit Codes	: -1 if any file failed, or the output didn't all reach the disk
+  Side Effects	: frees x
+  --------------------------------------------------------------------
+Comments:
+	Lets every queued copy complete and tears the extraction down.
+
+--------------------------------------------------------------------
+Changes:
+	Split out of unback_extract().
+
+\------------------------------------------------------------------*/
+static int ctx_finish( struct unback_ctx *x, struct unback_stats *stats ) {
+	int rc = 0;
+
+	if (x->sched) sched_finish( x );
+	if (x->pf.nthreads) prefetch_finish( x );
+	if (x->pool.nthreads) pool_finish( x );
+
+	dircache_flush( x );
+	if ((x->output_fd != -1)&&(x->o.durability != UNBACK_DURABILITY_NONE)&&(syncer_finish( x ) != 0)) rc = -1;
+	if (x->failed) {
+		fprintf(stderr,"ERROR: %llu files could not be extracted\n", (unsigned long long)x->failed);
+		rc = -1;
+	}
+	if (stats) stats_fill( x, stats );
+	if (x->output_fd != -1) close(x->output_fd);
+	pthread_mutex_destroy(&x->dircache_lock);
+	pthread_mutex_destroy(&x->th.lock);
+	free(x);
+
+	return rc;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20161221-131838
+  Function Name	: unback_extract
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback *u, 
+  2.  const struct unback_options *o, 
+  3.  struct unback_stats *stats , 
+  ------------------
+  Exit Codes	: -1 if the output or the manifest couldn't be used, or any file failed
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Extracts the backup in to o->outputpath, reporting each record
+	and copy through o->event.  Final totals are written to stats
+	if it isn't NULL.
+
+--------------------------------------------------------------------
+Changes:
+	Was the decode part of main().
+
+\------------------------------------------------------------------*/
+int unback_extract( struct unback *u, const struct unback_options *o, struct unback_stats *stats ) {
+	struct unback_ctx *x;
+	int rc;
+
+	x = ctx_start( u, o, &rc );
+	if (x == NULL) return -1;
+	if (rc == 0) rc = ctx_decode( x );
+	if (ctx_finish( x, stats ) != 0) rc = -1;
+
+	return rc;
+}
+
+
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20170201-212110
+  Function Name	: unback_tail
+  Returns Type	: int
+  ----Parameter List
+  1. struct unback *u, 
+  2.  const struct unback_options *o, 
+  3.  struct unback_stats *stats , 
+  ------------------
+  Exit Codes	: -1 if the output couldn't be used, no manifest turned up, or any file failed
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+	Extracts a backup whilst idevicebackup2 is still writing it,
+	u being from unback_open_live().  The backup folder and its
+	shard folders are watched with inotify, and each blob is
+	extracted as soon as it is closed after writing, provided the
+	manifest says where it goes.
+
+	Once the backup is finished, or nothing has happened for
+	o->tail_idle seconds (if not 0), a normal extraction pass is
+	run against the final manifest which skips every blob already
+	extracted and unchanged since.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int unback_tail( struct unback *u, const struct unback_options *o, struct unback_stats *stats ) {
+	struct unback_ctx *x;
+	struct tail *t;
+	struct pollfd pfd;
+	struct inotify_event *ev;
+	struct timespec now, last;
+	char *buf, *p, name[3];
+	ssize_t n;
+	int rc, i;
+
+	x = ctx_start( u, o, &rc );
+	if (x == NULL) return -1;
+	t = calloc(1, sizeof(struct tail));
+	if (t) pthread_mutex_init(&t->lock, NULL);
+	buf = malloc(TAIL_EVENT_BUFFER);
+	if ((rc == 0)&&((t == NULL)||(buf == NULL))) rc = -1;
+
+	if (rc == 0) {
+		x->tail = t;
+		t->ifd = inotify_init1( IN_CLOEXEC );
+		t->root_wd = inotify_add_watch( t->ifd, u->inputpath, IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE|IN_ONLYDIR );
+		if ((t->ifd == -1)||(t->root_wd == -1)) {
+			fprintf(stderr,"Cannot watch '%s' (%s)\n", u->inputpath, strerror(errno));
+			rc = -1;
+		}
+	}
+
+	if (rc == 0) {
+		for (i = 0; i < 256; i++) {
+			t->shard_wd[i] = -1;
+			snprintf(name, sizeof(name), "%02x", i);
+			if (faccessat( u->input_fd, name, F_OK, 0 ) == 0) tail_watch_shard( x, name );
+		}
+		if (u->manifest_type != UNBACK_MANIFEST_NONE) tail_load( x );
+
+		pfd.fd = t->ifd;
+		pfd.events = POLLIN;
+		clock_gettime(CLOCK_MONOTONIC, &last);
+		while (!t->finished) {
+			if (poll( &pfd, 1, 1000 ) <= 0) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				if ((x->o.tail_idle > 0)&&(now.tv_sec -last.tv_sec >= x->o.tail_idle)) break;
+				continue;
+			}
+
+			n = read( t->ifd, buf, TAIL_EVENT_BUFFER );
+			if (n <= 0) continue;
+			for (p = buf; p < buf +n; p += sizeof(struct inotify_event) +ev->len) {
+				ev = (struct inotify_event *)p;
+				tail_event( x, ev );
+			}
+			clock_gettime(CLOCK_MONOTONIC, &last);
+		}
+		close(t->ifd);
+		if (x->pool.nthreads) pool_drain( x );
+
+		/*
+		 * Reconcile against the final manifest, once the copies
+		 * made whilst tailing have finished, looking again for
+		 * shards which were missing when last tried.
+		 */
+		pthread_mutex_lock(&u->shard_lock);
+		for (i = 0; i < 256; i++) if (u->shard_fd[i] == -2) u->shard_fd[i] = -1;
+		pthread_mutex_unlock(&u->shard_lock);
+
+		if (manifest_detect( u ) == 0) {
+			rc = ctx_decode( x );
+		} else {
+			fprintf(stderr,"No manifest was written to '%s'\n", u->inputpath);
+			rc = -1;
+		}
+	}
+
+	if (ctx_finish( x, stats ) != 0) rc = -1;
+
+	if (t) {
+		for (i = 0; (size_t)i < t->size; i++) free(t->tab[i].rb);
+		pthread_mutex_destroy(&t->lock);
+		free(t->tab);
+		free(t);
+	}
+	free(buf);
+
+	return rc;
+}
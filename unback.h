@@ -0,0 +1,223 @@
+/*
+ * MIT licence
+ *
+ *
+ Copyright (c) 2016 Paul L Daniels
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the Software
+ is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ *
+ */
+
+/*
+ * libunback - decode idevicebackup2 manifests and extract the backed
+ * up files in to a human readable tree.
+ *
+ * Everything hangs off a 'struct unback' returned by unback_open(),
+ * there is no global state so several backups can be handled at once
+ * from different threads.  A single handle may also be shared by
+ * several cursors or extractions at the same time.
+ */
+
+#ifndef UNBACK_H
+#define UNBACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define UNBACK_MANIFEST_NONE -1  // unback_open_live(), no manifest yet
+#define UNBACK_MANIFEST_MBDB 0   // Manifest.mbdb, before iOS 10
+#define UNBACK_MANIFEST_SQL 1    // Manifest.db, iOS 10 onwards
+
+#define UNBACK_TYPE_FILE 1
+#define UNBACK_TYPE_DIR 2
+#define UNBACK_TYPE_SYMLINK 3
+#define UNBACK_TYPE_OTHER 4
+
+#define UNBACK_CURSOR_FILEBLOB 0x01  // fill in unback_record.file (Manifest.db only)
+
+#define UNBACK_JOBS_AUTO -1
+
+#define UNBACK_DURABILITY_NONE 0   // leave it to the kernel
+#define UNBACK_DURABILITY_BATCH 1  // fsync in the background, all on disk when unback_extract() returns
+#define UNBACK_DURABILITY_FILE 2   // each file is on disk before its COPIED / LINKED event
+
+#define UNBACK_SINK_SPARSE 0x01  // open_file(), the source has holes, don't preallocate
+
+#define UNBACK_EVENT_ENTRY 0     // every decoded record, before filtering
+#define UNBACK_EVENT_COPIED 1
+#define UNBACK_EVENT_LINKED 2
+#define UNBACK_EVENT_FOUND 3     // decode_only, the blob is present
+#define UNBACK_EVENT_MISSING 4   // the blob isn't in the backup
+#define UNBACK_EVENT_FAILED 5
+
+/*
+ * A string inside the manifest.  Not copied, and not necessarily
+ * NUL terminated (fileID always is), only valid until the next call
+ * to unback_cursor_next() or the event callback returns.
+ */
+struct unback_string {
+	const char *s;
+	size_t len;
+};
+
+struct unback_record {
+	int type;                       // UNBACK_TYPE_*
+	struct unback_string fileID;    // blob name, SHA1 of domain-path
+	struct unback_string domain;
+	struct unback_string path;      // relative to the domain
+	struct unback_string target;    // symlink target, mbdb only
+	struct unback_string digest;    // mbdb only
+	struct unback_string enckey;    // mbdb only
+	struct unback_string file;      // Manifest.db 'file' plist with UNBACK_CURSOR_FILEBLOB
+	uint16_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t mtime;
+	uint32_t atime;
+	uint32_t ctime;
+	uint64_t inode;
+	uint64_t size;                  // 0 when the manifest doesn't say
+	uint8_t protection;
+	uint8_t numprops;
+	const char *props;              // see unback_record_prop()
+};
+
+struct unback_stats {
+	uint64_t files;
+	uint64_t bytes;
+	uint64_t latency_ns;            // summed over all files
+	uint64_t prefetched;            // blobs hinted by the read-ahead
+	uint64_t throttle_ns;           // waiting on max_bandwidth / max_iops, summed over all copies
+	uint64_t peak_rss;              // bytes, of the whole process
+	int jobs;                       // copy workers currently allowed to run
+	double secs;
+};
+
+/*
+ * Priority rule, a file record goes in to the tier of the first rule
+ * it matches.  Lower tiers are extracted first, and each is complete
+ * before the next one starts.  Records no rule matches are extracted
+ * last.
+ */
+struct unback_rule {
+	const char *domain;    // fnmatch() pattern, NULL matches any domain
+	const char *path;      // fnmatch() pattern on the relative path, NULL for any
+	int tier;
+};
+
+/*
+ * Callbacks.  With jobs or decoders set these are called from the
+ * worker threads, possibly several at once.
+ *
+ * filter returns non-zero for the file records to extract.
+ */
+typedef int (*unback_filter_fn)( void *arg, const struct unback_record *r );
+typedef void (*unback_event_fn)( void *arg, int event, const struct unback_record *r );
+typedef void (*unback_progress_fn)( void *arg, const struct unback_stats *s );
+typedef void (*unback_tier_fn)( void *arg, int tier, uint64_t files );
+
+/*
+ * Where extracted files go.  The filesystem under outputpath is
+ * used unless unback_options.sink is set; unback_sink_null() only
+ * reads the blobs, unback_sink_memory() keeps everything in memory,
+ * or fill in your own.  Paths are relative to the root of the sink.
+ *
+ * begin_dir is called for the parent of each file before it is
+ * opened.  write is positional and may be called for several ranges
+ * of one file at once from different copy workers, it returns -1 if
+ * len bytes couldn't be written.  Blocks which are all zeros are
+ * skipped rather than written, so any range up to the size given
+ * to open_file which is never written must read back as zeros.
+ * close is always called once per opened file, with failed set if
+ * the copy didn't complete; times are the access and modification
+ * times, or NULL.  link is -l, in place of a copy of the blob in
+ * sdir.
+ */
+struct unback_sink {
+	int (*begin_dir)( struct unback_sink *k, const char *path );
+	void *(*open_file)( struct unback_sink *k, const char *path, uint64_t size, int flags );
+	int (*write)( struct unback_sink *k, void *file, const void *buf, size_t len, uint64_t off );
+	int (*close)( struct unback_sink *k, void *file, const struct timespec *times, int failed );
+	int (*link)( struct unback_sink *k, const char *path, int sdir, const char *blob );
+	void *arg;
+};
+
+/*
+ * throttle_file is checked once a second during the extraction, and
+ * whenever it changes the limits in it replace the current ones.  One
+ * per line, "bandwidth 50M" or "iops 200" (K, M and G are powers of
+ * 1024), 0 or none lifts the limit.
+ */
+struct unback_options {
+	const char *outputpath;
+	struct unback_sink *sink;  // NULL writes under outputpath
+	int linkonly;          // hard link to the blobs instead of copying
+	int decode_only;       // only report, don't create anything
+	int jobs;              // copy workers, 0 copies inline, or UNBACK_JOBS_AUTO
+	int decoders;          // Manifest.db decoder threads
+	int ordered;           // keep manifest order across decoder threads
+	int prefetch;          // read-ahead window, in blobs, 0 for none
+	int streaming;         // drop copied data from the page cache as we go
+	uint64_t direct_above; // O_DIRECT for blobs of this size or more, 0 never
+	uint64_t chunk_above;  // with jobs, copy blobs of this size or more as parallel ranges, 0 never
+	uint64_t chunk_size;   // size of those ranges, 0 for 64M
+	int durability;        // UNBACK_DURABILITY_*
+	int tail_idle;         // unback_tail(), seconds without activity that count as finished, 0 never
+	uint64_t max_bandwidth; // bytes per second read across all copies, 0 unlimited
+	uint64_t max_iops;     // reads and writes per second across all copies, 0 unlimited
+	const char *throttle_file;  // new limits for the above, see below
+	int shard_index;       // only extract shard_index of shard_count
+	int shard_count;
+	int cursor_flags;      // UNBACK_CURSOR_* for the records given to filter and ENTRY
+	const struct unback_rule *rules;  // priority rules, see above
+	int nrules;
+	int smallest_first;    // within a tier, extract the smallest files first
+	uint64_t memory_budget;  // bytes of records held for the above and the copy queue, 0 unlimited
+	const char *spill_dir; // sort runs over memory_budget go here, NULL for TMPDIR or /tmp
+	unback_filter_fn filter;
+	unback_event_fn event;
+	unback_progress_fn progress;  // once a second whilst copying with jobs
+	unback_tier_fn tier_done;     // each priority tier is on disk
+	void *arg;             // passed to the callbacks
+};
+
+struct unback;
+struct unback_cursor;
+
+struct unback *unback_open( const char *inputpath );
+struct unback *unback_open_live( const char *inputpath );
+void unback_close( struct unback *u );
+int unback_manifest_type( struct unback *u );
+
+struct unback_cursor *unback_cursor_open( struct unback *u, int flags );
+int unback_cursor_next( struct unback_cursor *c, struct unback_record *r );
+void unback_cursor_close( struct unback_cursor *c );
+int unback_record_prop( const struct unback_record *r, int i, struct unback_string *name, struct unback_string *value );
+
+int unback_blob_path( struct unback *u, const struct unback_record *r, char *buf, size_t len );
+int unback_blob_stat( struct unback *u, const struct unback_record *r, struct stat *st );
+int unback_shard_of( const char *fileID, int count );
+int unback_parse_size( const char *s, uint64_t *size );
+
+struct unback_sink *unback_sink_null( void );
+struct unback_sink *unback_sink_memory( void );
+const void *unback_sink_memory_get( struct unback_sink *k, const char *path, uint64_t *size );
+void unback_sink_memory_usage( struct unback_sink *k, uint64_t *files, uint64_t *bytes );
+void unback_sink_free( struct unback_sink *k );
+
+void unback_options_init( struct unback_options *o );
+int unback_extract( struct unback *u, const struct unback_options *o, struct unback_stats *stats );
+int unback_tail( struct unback *u, const struct unback_options *o, struct unback_stats *stats );
+
+#endif // UNBACK_H